@@ -0,0 +1,193 @@
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/moduleparam.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/random.h>
+#include <linux/ktime.h>
+#include <linux/timex.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+#include <linux/preempt.h>
+#include "../rotchardev/rot.h"
+#include "../hardcryptor/rc4.h"
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("putsi");
+MODULE_DESCRIPTION("Benchmark of the rot and rc4 transforms without syscall overhead");
+MODULE_VERSION("1.0");
+
+// Size of the result string, fits a line for every transform.
+#define RESULTS_SIZE 512
+// Iterations are timed in batches of about this many bytes, rescheduling is done between the batches.
+#define BATCH_BYTES (1 << 20)
+// Key used for the rc4 transforms, the cost doesn't depend on its contents.
+#define BENCH_KEY "benchmarkKeyForRc4"
+
+// Transforms to benchmark, comma separated list or "all".
+static char *transform = "all";
+// transform is char pointer and can be read but cannot be modified.
+module_param(transform, charp, S_IRUGO);
+// transform parameter description.
+MODULE_PARM_DESC(transform, "Transforms to benchmark: rot, rc4, rc4-reset, rc4-setup or all.");
+
+// Size of the buffer that is transformed on every iteration.
+static unsigned int bufSize = 1024;
+module_param(bufSize, uint, S_IRUGO);
+MODULE_PARM_DESC(bufSize, "Bytes transformed per iteration (default 1024).");
+
+// Amount of timed iterations per transform.
+static unsigned int iterations = 10000;
+module_param(iterations, uint, S_IRUGO);
+MODULE_PARM_DESC(iterations, "Iterations per transform (default 10000).");
+
+// Rotation amount used by the rot transform.
+static int rotations = 13;
+module_param(rotations, int, S_IRUGO);
+MODULE_PARM_DESC(rotations, "Rotation amount of the rot transform (default 13).");
+
+// Results of the benchmark, one line per transform, filled at load time.
+static char results[RESULTS_SIZE];
+// results can be read but cannot be modified.
+module_param_string(results, results, RESULTS_SIZE, S_IRUGO);
+MODULE_PARM_DESC(results, "Measured ns/byte and cycles/byte of every transform.");
+
+// Function type of a single benchmarked iteration.
+typedef void (*bench_fn)(unsigned char *buf, size_t len);
+
+static void (*rotFn)(char* buf, size_t len, int rotations);
+static struct rc4_state keyState;
+static struct rc4_state streamState;
+
+// Rotate the buffer with the rot module.
+static void bench_rot(unsigned char *buf, size_t len) {
+	rotFn(buf, len, rotations);
+}
+
+// Continue one RC4-stream over all iterations.
+static void bench_rc4(unsigned char *buf, size_t len) {
+	rc4_crypt(&streamState, buf, len);
+}
+
+// Start every iteration from the beginning of the RC4-stream, like hardcryptor does for every message.
+static void bench_rc4_reset(unsigned char *buf, size_t len) {
+	struct rc4_state state = keyState;
+
+	rc4_crypt(&state, buf, len);
+}
+
+// Set up the key on every iteration, like hardcryptor does when the key changes.
+static void bench_rc4_setup(unsigned char *buf, size_t len) {
+	struct rc4_state state;
+
+	rc4_key_setup(&state, BENCH_KEY, strlen(BENCH_KEY));
+	rc4_crypt(&state, buf, len);
+}
+
+// Returns true if name is selected by the transform parameter.
+static bool selected(const char *name) {
+	const char *p = transform;
+	size_t len = strlen(name);
+
+	if (strcmp(transform, "all") == 0) {
+		return true;
+	}
+	while ((p = strstr(p, name)) != NULL) {
+		if ((p == transform || p[-1] == ',') && (p[len] == '\0' || p[len] == ',')) {
+			return true;
+		}
+		p += len;
+	}
+	return false;
+}
+
+// Time iterations of the function and append the result line.
+static void run(const char *name, bench_fn fn, unsigned char *buf) {
+	u64 bytes = (u64)bufSize * iterations;
+	unsigned int batch = max_t(unsigned int, BATCH_BYTES / bufSize, 1);
+	u64 startNs, ns = 0;
+	cycles_t startCycles, cycles = 0;
+	u64 nsPerKByte, cyclesPerKByte;
+	size_t used = strlen(results);
+	unsigned int i, j;
+
+	// One untimed iteration to warm up the caches.
+	fn(buf, bufSize);
+
+	// Only the batches are timed, with preemption disabled, so rescheduling is never counted as transform time.
+	for (i = 0; i < iterations; i += batch) {
+		batch = min(batch, iterations - i);
+		preempt_disable();
+		startNs = ktime_get_ns();
+		startCycles = get_cycles();
+		for (j = 0; j < batch; j++) {
+			fn(buf, bufSize);
+		}
+		cycles += get_cycles() - startCycles;
+		ns += ktime_get_ns() - startNs;
+		preempt_enable();
+		// Long runs must not trigger the soft lockup detector.
+		cond_resched();
+	}
+
+	// Results are printed with three decimals, kernel has no floating point.
+	nsPerKByte = div64_u64(ns * 1000, bytes);
+	cyclesPerKByte = div64_u64((u64)cycles * 1000, bytes);
+	scnprintf(results + used, RESULTS_SIZE - used,
+		  "%s ns/byte=%llu.%03llu cycles/byte=%llu.%03llu\n", name,
+		  nsPerKByte / 1000, nsPerKByte % 1000,
+		  cyclesPerKByte / 1000, cyclesPerKByte % 1000);
+	printk(KERN_INFO "bench: %s", results + used);
+}
+
+// Function which will be executed at module initialization time.
+static int __init bench_init(void) {
+	unsigned char *buf;
+
+	if (bufSize == 0 || iterations == 0) {
+		printk(KERN_ALERT "bench: bufSize and iterations must be bigger than zero.\n");
+		return -EINVAL;
+	}
+	buf = kvmalloc(bufSize, GFP_KERNEL);
+	if (buf == NULL) {
+		return -ENOMEM;
+	}
+	get_random_bytes(buf, bufSize);
+	rc4_key_setup(&keyState, BENCH_KEY, strlen(BENCH_KEY));
+	streamState = keyState;
+
+	printk(KERN_INFO "bench: %u iterations of %u bytes.\n", iterations, bufSize);
+	if (selected("rot")) {
+		// rot transform is used only if the rot module happens to be loaded.
+		rotFn = symbol_get(rot_transform);
+		if (rotFn != NULL) {
+			run("rot", bench_rot, buf);
+			symbol_put(rot_transform);
+		} else {
+			printk(KERN_NOTICE "bench: rot module is not loaded, skipping rot.\n");
+		}
+	}
+	if (selected("rc4")) {
+		run("rc4", bench_rc4, buf);
+	}
+	if (selected("rc4-reset")) {
+		run("rc4-reset", bench_rc4_reset, buf);
+	}
+	if (selected("rc4-setup")) {
+		run("rc4-setup", bench_rc4_setup, buf);
+	}
+
+	kvfree(buf);
+	return 0;
+}
+
+// Function which will be executed on module cleanup time.
+static void __exit bench_exit(void) {
+	printk(KERN_INFO "bench: Unloaded.\n");
+}
+
+// Specify module initialization and cleanup functions.
+module_init(bench_init);
+module_exit(bench_exit);
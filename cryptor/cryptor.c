@@ -10,6 +10,16 @@
 #include <linux/fs.h>
 /* Uaccess-headers, needed for copying data between user space and Kernel space. */
 #include <asm/uaccess.h>
+/* Slab headers, needed for allocating the sessions and the keys. */
+#include <linux/slab.h>
+/* Mutex headers, needed for serializing the key updates and the use of a session. */
+#include <linux/mutex.h>
+/* RCU headers, needed for reading the key without locks. */
+#include <linux/rcupdate.h>
+/* String headers, needed for e.g. memzero_explicit. */
+#include <linux/string.h>
+/* Version headers, needed for the device class interface which differs between kernel versions. */
+#include <linux/version.h>
 
 /* Set the licence, author, version, and description of the module. */
 MODULE_LICENSE("GPL");
@@ -20,6 +30,8 @@ MODULE_VERSION("1.2");
 
 /* Maximum size of message in a single write- or read-operation. */
 #define MESSAGE_MAX_SIZE 1024
+/* Maximum size of the encryption key, RC4 uses at most 256 bytes of it. */
+#define KEY_MAX_SIZE 256
 /* Device name which will be used in the file system (/dev/cry). */
 #define DEVICE_NAME "cry"
 /* Class name defines which class the module is specific to. */
@@ -29,20 +41,46 @@ MODULE_VERSION("1.2");
 #define IOCTL_SET_KEY 0
 #define IOCTL_GET_KEY 1
 
-static char *encryptionKey;
-/* Encryption key is char pointer (charp) that can be read and write by root (S_IRWXU). */
-module_param(encryptionKey, charp, S_IRWXU);
+/* Encryption key and its RC4 key schedule, replaced as a whole when the key changes. */
+/* Readers use it under rcu_read_lock, old keys are wiped and freed after a grace period. */
+struct cry_key {
+	struct rcu_head rcu;
+	unsigned char schedule[256];
+	size_t len;
+	char key[KEY_MAX_SIZE];
+};
+
+/* Current encryption key, NULL until one is set. */
+static struct cry_key __rcu *encryptionKey;
+/* Serializes the key updates, readers don't take it. */
+static DEFINE_MUTEX(keyLock);
+
+/* Functions for setting and getting the encryption key as a module parameter. */
+static int cry_param_set_key(const char *val, const struct kernel_param *kp);
+static int cry_param_get_key(char *buffer, const struct kernel_param *kp);
+
+static const struct kernel_param_ops keyOps = {
+	.set = cry_param_set_key,
+	.get = cry_param_get_key,
+};
+/* Encryption key can be read and write by root (S_IRWXU). */
+module_param_cb(encryptionKey, &keyOps, NULL, S_IRWXU);
 /* Encryption key parameter description for the module. */
 MODULE_PARM_DESC(encryptionKey,
 		 "Encryption key that will be used in cryptography operations.");
 
 /* Device major number maps the device file to the corresponding driver. */
 static int majorNum;
-/* Initialize memory for the message. */
-static char msg[MESSAGE_MAX_SIZE] = { 0 };
 
-/* Variable for storing length of the string. */
-static short msgSize;
+/* State of a single opened device file. */
+struct cry_session {
+	/* Serializes reads and writes of the same file. */
+	struct mutex lock;
+	/* Memory for the message. */
+	char msg[MESSAGE_MAX_SIZE];
+	/* Variable for storing length of the string. */
+	short msgSize;
+};
 
 /* The basic device class. */
 static struct class *cryClass;
@@ -71,7 +109,74 @@ static struct file_operations fops = {
 };
 
 /* Function prototype for the rc4 based encryption. */
-void rc4(unsigned char *key, unsigned char *msg);
+void rc4(const unsigned char schedule[], unsigned char *msg, size_t len);
+void rc4_key_setup(unsigned char state[], const unsigned char key[], int len);
+
+/* Wipe and free a key once no encryptor can be using it anymore. */
+static void cry_free_key(struct rcu_head *head)
+{
+	struct cry_key *key = container_of(head, struct cry_key, rcu);
+
+	memzero_explicit(key, sizeof(*key));
+	kfree(key);
+}
+
+/* Replace the encryption key with a copy of the given key. */
+static int cry_set_key(const char *key, size_t len)
+{
+	struct cry_key *newKey;
+	struct cry_key *oldKey;
+
+	if (len == 0 || len >= KEY_MAX_SIZE) {
+		return -EINVAL;
+	}
+	newKey = kzalloc(sizeof(*newKey), GFP_KERNEL);
+	if (newKey == NULL) {
+		return -ENOMEM;
+	}
+	memcpy(newKey->key, key, len);
+	newKey->len = len;
+	rc4_key_setup(newKey->schedule, newKey->key, len);
+
+	/* Encryptors see either the old or the new key, never a mix of them. */
+	mutex_lock(&keyLock);
+	oldKey = rcu_dereference_protected(encryptionKey,
+					   lockdep_is_held(&keyLock));
+	rcu_assign_pointer(encryptionKey, newKey);
+	mutex_unlock(&keyLock);
+
+	if (oldKey != NULL) {
+		call_rcu(&oldKey->rcu, cry_free_key);
+	}
+	return 0;
+}
+
+/* This is called when the encryption key is given at load time or written to the module parameter. */
+static int cry_param_set_key(const char *val, const struct kernel_param *kp)
+{
+	size_t len = strlen(val);
+
+	/* Writes to the parameter file usually end with a newline. */
+	if (len > 0 && val[len - 1] == '\n') {
+		len--;
+	}
+	return cry_set_key(val, len);
+}
+
+/* This is called when the module parameter is read. */
+static int cry_param_get_key(char *buffer, const struct kernel_param *kp)
+{
+	struct cry_key *key;
+	int len = 0;
+
+	rcu_read_lock();
+	key = rcu_dereference(encryptionKey);
+	if (key != NULL) {
+		len = scnprintf(buffer, PAGE_SIZE, "%s\n", key->key);
+	}
+	rcu_read_unlock();
+	return len;
+}
 
 /* This function will be executed at module initialization time. */
 static int __init cry_init(void)
@@ -89,7 +194,11 @@ static int __init cry_init(void)
 	       majorNum);
 
 	/* Create a struct class structure which will be used in creating the device. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+	cryClass = class_create(CLASS_NAME);
+#else
 	cryClass = class_create(THIS_MODULE, CLASS_NAME);
+#endif
 	if (IS_ERR(cryClass)) {
 		/* Unregister the character device as we could not create the device class. */
 		unregister_chrdev(majorNum, DEVICE_NAME);
@@ -119,22 +228,43 @@ static int __init cry_init(void)
 /* This function which will be executed on the module cleanup time. */
 static void __exit cry_exit(void)
 {
+	struct cry_key *key;
+
 	/* Destroy the device, destroy the class and unregister the character device. */
 	device_destroy(cryClass, MKDEV(majorNum, 0));
 	class_destroy(cryClass);
 	unregister_chrdev(majorNum, DEVICE_NAME);
+
+	/* Free the current key and wait for the old keys to be freed before the module goes away. */
+	key = rcu_dereference_protected(encryptionKey, true);
+	RCU_INIT_POINTER(encryptionKey, NULL);
+	if (key != NULL) {
+		call_rcu(&key->rcu, cry_free_key);
+	}
+	rcu_barrier();
 	printk(KERN_INFO "cryptor: LKM unloaded successfully.\n");
 }
 
 /* This is called when the user tries to open the character device file. */
 static int cry_open(struct inode *inodep, struct file *filep)
 {
+	struct cry_session *session;
+
 	/* If there is no encryption key, return an invalid argument error. */
-	if (encryptionKey == NULL) {
+	if (rcu_access_pointer(encryptionKey) == NULL) {
 		printk(KERN_NOTICE
 		       "cryptor: User tried to use the device when there was no encryption key present.");
 		return -EINVAL;
 	}
+
+	/* Every opened file gets its own message, so encryptors don't share any state. */
+	session = kzalloc(sizeof(*session), GFP_KERNEL);
+	if (session == NULL) {
+		return -ENOMEM;
+	}
+	mutex_init(&session->lock);
+	filep->private_data = session;
+
 	printk(KERN_INFO "cryptor: User opened the device.\n");
 	return 0;
 }
@@ -143,19 +273,23 @@ static int cry_open(struct inode *inodep, struct file *filep)
 static ssize_t
 cry_read(struct file *filep, char *buffer, size_t len, loff_t *offset)
 {
+	struct cry_session *session = filep->private_data;
 	int errorCount = 0;
-	/* Copy the saved message from the global variable to user space. */
+	mutex_lock(&session->lock);
+	/* Copy the saved message from the session to user space. */
 	/* If there were any errors, return an I/O Error. */
-	errorCount = copy_to_user(buffer, msg, msgSize);
+	errorCount = copy_to_user(buffer, session->msg, session->msgSize);
 	if (errorCount == 0) {
 		printk(KERN_INFO "cryptor: Sent %d characters to user.\n",
-		       msgSize);
-		msgSize = 0;
+		       session->msgSize);
+		session->msgSize = 0;
+		mutex_unlock(&session->lock);
 		return (0);
 	} else {
 		printk(KERN_ALERT
 		       "cryptor: Could not send %d characters to user!\n",
-		       msgSize);
+		       session->msgSize);
+		mutex_unlock(&session->lock);
 		return -EIO;
 	}
 }
@@ -164,17 +298,44 @@ cry_read(struct file *filep, char *buffer, size_t len, loff_t *offset)
 static ssize_t
 cry_write(struct file *filep, const char *buffer, size_t len, loff_t *offset)
 {
+	struct cry_session *session = filep->private_data;
+	struct cry_key *key;
+	unsigned char schedule[256];
+	size_t charcount = MESSAGE_MAX_SIZE;
+
+	/* If length is shorter than maximum message size, use it. */
+	if (len < MESSAGE_MAX_SIZE) {
+		charcount = len;
+	}
+
+	/* Take a copy of the key schedule, the key may be replaced while the message is encrypted. */
+	rcu_read_lock();
+	key = rcu_dereference(encryptionKey);
+	if (key == NULL) {
+		rcu_read_unlock();
+		return -EINVAL;
+	}
+	memcpy(schedule, key->schedule, sizeof(schedule));
+	rcu_read_unlock();
+
+	mutex_lock(&session->lock);
 	/* Write characters in input buffer to the message. */
-	sprintf(msg, "%s", buffer);
-	msgSize = strlen(msg);
+	if (copy_from_user(session->msg, buffer, charcount) != 0) {
+		mutex_unlock(&session->lock);
+		memzero_explicit(schedule, sizeof(schedule));
+		return -EFAULT;
+	}
+	session->msgSize = charcount;
 	printk(KERN_INFO "cryptor: Received %d characters to device!\n",
-	       msgSize);
+	       session->msgSize);
 
 	/* Lets encrypt/decrypt the message. */
 	printk(KERN_INFO "cryptor: Encrypting/decrypting the message.");
-	rc4(encryptionKey, msg);
+	rc4(schedule, session->msg, session->msgSize);
+	mutex_unlock(&session->lock);
+	memzero_explicit(schedule, sizeof(schedule));
 	/* Return the amount of characters that were encrypted/decrypted. */
-	return msgSize;
+	return charcount;
 }
 
 /* This is called when a process tries to do an ioctl call to the character device file. */
@@ -182,21 +343,43 @@ static long
 cry_ioctl(struct file *file, unsigned int ioctl_cmd, unsigned long arg)
 {
 	int ret_val = 0;
+	struct cry_key *key;
+	char *buf;
+	long keyLen;
+
+	/* Key is copied through a buffer, user memory can't be accessed while reading the key under RCU. */
+	buf = kzalloc(KEY_MAX_SIZE, GFP_KERNEL);
+	if (buf == NULL) {
+		return -ENOMEM;
+	}
+
 	/* Find out if the user wants to set or get the encryption key. */
 	switch (ioctl_cmd) {
 	case IOCTL_SET_KEY:
-		/* Copy data from user space to the encryption key variable (Kernel space). */
-		ret_val =
-		    copy_from_user(encryptionKey, (char *)arg,
-				   sizeof(encryptionKey));
-		printk(KERN_INFO
-		       "cryptor: User changed encryption key via IOCTL.\n");
+		/* Copy data from user space to a new encryption key (Kernel space). */
+		keyLen = strncpy_from_user(buf, (char *)arg, KEY_MAX_SIZE);
+		if (keyLen < 0) {
+			ret_val = -EFAULT;
+			break;
+		}
+		ret_val = cry_set_key(buf, keyLen);
+		if (ret_val == 0) {
+			printk(KERN_INFO
+			       "cryptor: User changed encryption key via IOCTL.\n");
+		}
 		break;
 	case IOCTL_GET_KEY:
-		/* Copy data from the encryption key variable (Kernel space) to user space. */
-		ret_val =
-		    copy_to_user((char *)arg, encryptionKey,
-				 sizeof(encryptionKey));
+		rcu_read_lock();
+		key = rcu_dereference(encryptionKey);
+		if (key != NULL) {
+			memcpy(buf, key->key, key->len + 1);
+		}
+		rcu_read_unlock();
+		/* Copy data from the encryption key (Kernel space) to user space. */
+		if (copy_to_user((char *)arg, buf, strlen(buf) + 1) != 0) {
+			ret_val = -EFAULT;
+			break;
+		}
 		printk(KERN_INFO
 		       "cryptor: Encryption key sent to user via IOCTL.\n");
 		break;
@@ -207,12 +390,20 @@ cry_ioctl(struct file *file, unsigned int ioctl_cmd, unsigned long arg)
 		       ioctl_cmd);
 		break;
 	}
+
+	memzero_explicit(buf, KEY_MAX_SIZE);
+	kfree(buf);
 	return ret_val;
 }
 
 /* This is called when a process closes the character device file. */
 static int cry_release(struct inode *inodep, struct file *filep)
 {
+	struct cry_session *session = filep->private_data;
+
+	/* Avoid possible information leaks by clearing the message. */
+	memzero_explicit(session, sizeof(*session));
+	kfree(session);
 	printk(KERN_INFO "cryptor: Device closed succesfully.\n");
 	return 0;
 }
@@ -259,15 +450,18 @@ void rc4_generate_stream(unsigned char state[], unsigned char out[], size_t len)
 	}
 }
 
-void rc4(unsigned char *key, unsigned char *msg)
+void rc4(const unsigned char schedule[], unsigned char *msg, size_t len)
 {
 	unsigned char state[256];
 	unsigned char buf[MESSAGE_MAX_SIZE];
 	size_t i;
 
-	rc4_key_setup(state, key, strlen(key));
-	rc4_generate_stream(state, buf, MESSAGE_MAX_SIZE);
-	for (i = 0; i < strlen(msg); i++) {
+	/* Key schedule is shared, the stream is generated from a copy of it. */
+	memcpy(state, schedule, sizeof(state));
+	rc4_generate_stream(state, buf, len);
+	for (i = 0; i < len; i++) {
 		msg[i] ^= buf[i];
 	}
+	memzero_explicit(state, sizeof(state));
+	memzero_explicit(buf, len);
 }
@@ -8,10 +8,50 @@
 #include <linux/fs.h>
 /* Mutex-headers, needed for removing possibility for a race condition. */
 #include <linux/mutex.h>
+/* Slab headers, needed for the caches of sessions, keys and messages. */
+#include <linux/slab.h>
+/* Workqueue, list, spinlock and completion headers, needed for scheduling the encryption work. */
+#include <linux/workqueue.h>
+/* Per-CPU and topology headers, needed for the CPU-local request queues. */
+#include <linux/percpu.h>
+#include <linux/topology.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/completion.h>
+/* Lock-less list headers, needed for collecting the retired buffers for the background wipe. */
+#include <linux/llist.h>
+/* Time headers, needed for measuring how long the work waits in the queue. */
+#include <linux/ktime.h>
+/* Capability headers, needed for checking who may raise the scheduling weight. */
+#include <linux/capability.h>
+/* CRC32C headers, needed for checksumming the messages while they are transformed. */
+#include <linux/crc32c.h>
+/* LZ4 headers, needed for compressing the messages before they are transformed. */
+#include <linux/lz4.h>
+/* Memory management headers, needed for allocating the compression work memory. */
+#include <linux/mm.h>
 /* Uaccess-headers, needed for copying data between user space and Kernel space. */
 #include <asm/uaccess.h>
 /* Include ctype headers, so that we can validate the user input. */
 #include <linux/ctype.h>
+/* Version headers, needed for the device class and io_uring interfaces which differ between kernel versions. */
+#include <linux/version.h>
+/* io_uring headers, needed for submitting encryption work through io_uring commands. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#include <linux/io_uring/cmd.h>
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+#include <linux/io_uring.h>
+#endif
+/* Scheduler headers, needed for checking whether the task which submitted an io_uring command is exiting. */
+#include <linux/sched.h>
+/* Crypto API headers, needed for registering the RC4-cipher as an skcipher algorithm. */
+#include <crypto/internal/skcipher.h>
+/* Device interface shared with user space, e.g. ioctl calls. */
+#include "hardcryptor.h"
+/* RC4-cipher, shared with the user space implementation of the device. */
+#include "rc4.h"
+/* Rotation transform exported by the rot module, used by the transform chains. */
+#include "../rotchardev/rot.h"
 
 /* Set the licence, author, version, and description of the module. */
 MODULE_LICENSE("GPL");
@@ -19,9 +59,13 @@ MODULE_AUTHOR("Jarmo Puttonen");
 MODULE_DESCRIPTION
     ("Character device that encrypts/decrypts given input by XORing with RC4-stream.");
 MODULE_VERSION("1.2");
+MODULE_ALIAS_CRYPTO("hcry-rc4");
+MODULE_ALIAS_CRYPTO("hcry-rc4-generic");
 
 /* Maximum size of message in a single write- or read-operation. */
 #define MESSAGE_MAX_SIZE 1024
+/* Size of the message buffers, a compressed frame of a maximum sized message can be a bit bigger than the message. */
+#define MESSAGE_BUF_SIZE (sizeof(struct cry_frame) + LZ4_COMPRESSBOUND(MESSAGE_MAX_SIZE))
 /* Minimum length for the encryption key. */
 #define KEY_MIN_SIZE 16
 /* Maximum length for the encryption key. */
@@ -30,23 +74,214 @@ MODULE_VERSION("1.2");
 #define DEVICE_NAME "hcry"
 /* Class name defines which class the module is specific to. */
 #define CLASS_NAME "hardcryptor"
+/* Name of the RC4-cipher in the kernel crypto API, e.g. for AF_ALG sockets. */
+/* Stream of the cipher differs from the standard RC4, so it must not be registered as "rc4". */
+#define CRYPTO_ALG_NAME "hcry-rc4"
+/* Driver name and priority of the RC4-cipher in the kernel crypto API. */
+#define CRYPTO_DRIVER_NAME "hcry-rc4-generic"
+#define CRYPTO_PRIORITY 100
+/* Maximum length for the crypto API key, RC4 uses at most 256 bytes of the key. */
+#define CRYPTO_KEY_MAX_SIZE 256
+/* io_uring commands are supported by the kernels which have the uring_cmd file operation. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+#define CRY_HAVE_URING_CMD
+#endif
+/* Queued io_uring commands are cancelled when their ring is torn down on the kernels where the task work */
+/* of the commands always runs with the ring locked, so a cancel never races with the completion of a job. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+#define CRY_HAVE_URING_CANCEL
+#endif
+/* Size of the block which all stages of a chain are applied to before moving to the next block. */
+#define CHAIN_BLOCK_SIZE 64
+/* Largest chunk of physically contiguous memory a staging buffer is allocated in. */
+/* Fewer chunks mean fewer scheduled segments and remapped ranges, smaller ones are used under fragmentation. */
+#define STAGING_CHUNK_SIZE SZ_2M
+/* Bytes transformed at a time on the read path of the lazy mode, small enough to stay in the cache. */
+#define LAZY_BLOCK_SIZE 256
 
-/* Magic number for the ioctl calls */
-#define CRY_IOC_MAGIC 'c'
-/* IOCTL-call values used for setting and getting the encryption key. */
-#define CRY_IOC_SET_KEY _IOW(CRY_IOC_MAGIC, 1, char*)
-#define CRY_IOC_GET_KEY _IOR(CRY_IOC_MAGIC, 2, char*)
+/* Amount of bytes a session with weight 1 may process before the next session gets its turn. */
+static unsigned int schedQuantum = 256;
+/* schedQuantum is unsigned int that can be read by everyone and changed by root. */
+module_param(schedQuantum, uint, S_IRUGO | S_IWUSR);
+/* schedQuantum parameter description. */
+MODULE_PARM_DESC(schedQuantum,
+		 "Bytes processed per scheduling round and weight unit (default 256).");
 
-/* Encryption-key will be stored here. */
-static char encryptionKey[KEY_MAX_SIZE] = { 0 };
+/* CPU whose queue processes all messages, -1 processes every message on the CPU that wrote it. */
+static int schedCpu = -1;
+/* schedCpu is int that can be read by everyone and changed by root. */
+module_param(schedCpu, int, S_IRUGO | S_IWUSR);
+/* schedCpu parameter description. */
+MODULE_PARM_DESC(schedCpu,
+		 "CPU which processes all messages, -1 for the writing CPU (default -1).");
+
+/* Milliseconds between the updates of the status page while it is mapped. */
+static unsigned int statusInterval = 10;
+/* statusInterval is unsigned int that can be read by everyone and changed by root. */
+module_param(statusInterval, uint, S_IRUGO | S_IWUSR);
+/* statusInterval parameter description. */
+MODULE_PARM_DESC(statusInterval,
+		 "Milliseconds between the status page updates (default 10).");
+
+/* Retired buffers are wiped in the background before they are returned to their caches. */
+static bool deferWipe = false;
+/* deferWipe is bool that can be read by everyone and changed by root. */
+module_param(deferWipe, bool, S_IRUGO | S_IWUSR);
+/* deferWipe parameter description. */
+MODULE_PARM_DESC(deferWipe,
+		 "Wipe freed keys, messages and sessions in a background batch (default 0).");
+
+/* Staging buffer of a session, made of chunks of physically contiguous memory. */
+struct cry_staging {
+	/* Size of the buffer, a multiple of the chunk size. */
+	size_t size;
+	/* Page order of the chunks, zero when the buffer is made of single pages. */
+	unsigned int order;
+	unsigned int count;
+	struct page *chunks[];
+};
+
+/* State of a single opened device file. */
+struct cry_session {
+	/* Mutex for making sure that at any time, only one operation of the session can be running. */
+	struct mutex lock;
+	/* Encryption-key will be stored here, allocated from the key cache. */
+	char *encryptionKey;
+	/* RC4-state prepared from the encryption key, so that the key setup is done only once per key. */
+	struct rc4_state keyState;
+	/* Memory for the message, allocated from the message cache. */
+	char *msg;
+	/* Variable for storing length of the message. */
+	short msgSize;
+	/* Bytes of the message buffer which have been written since it was last wiped. */
+	short msgDirty;
+	/* Transform chain which is applied to written messages, empty chain means plain RC4. */
+	struct cry_chain chain;
+	/* Rotation transform of the rot module, held while the chain has rotation stages. */
+	typeof(&rot_transform) rotTransform;
+	/* Scheduling weight of the session, only changed while the session has no jobs. */
+	unsigned int weight;
+	/* Bytes the session may still process during its turn, protected by the lock of its queue. */
+	long deficit;
+	/* Jobs of the session waiting to be processed, protected by the lock of its queue. */
+	struct list_head jobs;
+	/* Node in the list of sessions which have queued jobs, protected by the lock of its queue. */
+	struct list_head active;
+	/* Amount of jobs queued or being processed and the queue which processes them. */
+	/* All jobs of a session go to the same queue, so the session is never active in two queues. */
+	atomic_t pending;
+	struct cry_queue *queue;
+	/* Checksums which are computed from the messages and the checksums of the last message. */
+	struct cry_csum csum;
+	/* Compression mode of the session. */
+	unsigned int compress;
+	/* Second message buffer for the compression, allocated from the message cache when needed. */
+	char *scratch;
+	/* Message is stored as written and transformed while it is read. */
+	unsigned int lazy;
+	/* RC4-stream continues over the messages, from the state where the previous message ended. */
+	unsigned int stream;
+	struct rc4_state streamState;
+	/* Staging buffer which is transformed in place, and the amount of its mappings in user space. */
+	struct cry_staging *staging;
+	atomic_t stagingMaps;
+};
+
+/* Encryption work of a single message, which is processed by the scheduler in slices. */
+struct cry_job {
+	/* Node in the job list of the session. */
+	struct list_head node;
+	/* Session which the job belongs to. */
+	struct cry_session *session;
+	/* Message which will be transformed in place. */
+	unsigned char *buf;
+	size_t len;
+	/* How much of the message has been transformed so far. */
+	size_t done;
+	/* RC4-state of the message, kept between the slices. */
+	struct rc4_state state;
+	/* Checksums of the message, kept between the slices. */
+	struct cry_csum csum;
+	/* Queue which processes the job, set with the job added to the queue and protected by its lock. */
+	struct cry_queue *queue;
+	/* Weight class of the job and the time it was queued, used for the statistics. */
+	unsigned int weightClass;
+	u64 queuedAt;
+	/* Called by the scheduler when the whole message has been transformed, with the queue locked. */
+	void (*finish)(struct cry_job *job);
+	/* Completed by the finish function of jobs which are waited for. */
+	struct completion completion;
+	/* io_uring command which the job was submitted with. */
+	void *priv;
+};
+
+/* Retired buffer waiting for the background wipe, stored at the start of the buffer itself. */
+struct cry_retired {
+	struct llist_node node;
+	struct kmem_cache *cache;
+	size_t len;
+};
+
+/* Scheduler statistics of a single weight class, protected by the lock of the queue. */
+struct cry_class_stats {
+	/* Amount of jobs queued at the moment. */
+	unsigned int depth;
+	/* Amount of jobs started and the sum of the time they waited before starting. */
+	u64 jobs;
+	u64 waitNs;
+};
+
+/* Request queue of a single CPU, allocated from the memory of the CPU's node. */
+/* Messages are processed on the CPU which wrote them, so the fast path shares nothing with other CPUs. */
+struct cry_queue {
+	/* Lock protects the list of active sessions, their job lists and the statistics. */
+	spinlock_t lock;
+	/* Sessions which have queued jobs, in the order they get their turns. */
+	struct list_head active;
+	/* Statistics of each weight class, indexed by the weight. */
+	struct cry_class_stats stats[CRY_WEIGHT_MAX + 1];
+	/* Scheduler work of the queue, always queued on the CPU of the queue. */
+	struct work_struct work;
+	int cpu;
+	/* Job which the scheduler is transforming with the lock released, it can't be cancelled. */
+	struct cry_job *running;
+	/* Work memory of the LZ4 compressor, used with preemption disabled. */
+	void *lz4Workmem;
+};
+
+/* Counters of the status page, only changed on the local CPU and folded into the page by the status work. */
+/* Queued messages and sessions may be added on one CPU and removed on another, so only their sums are valid. */
+struct cry_counters {
+	u64 bytes;
+	u64 ops;
+	long queued;
+	long sessions;
+};
 
 /* Device major number maps the device file to the corresponding driver. */
 static int majorNum = -1;
-/* Initialize memory for the message. */
-static char msg[MESSAGE_MAX_SIZE] = { 0 };
 
-/* Variable for storing length of the string. */
-static short msgSize = -1;
+/* Caches for the sessions, encryption keys and messages, so memory use follows the amount of open sessions. */
+static struct kmem_cache *cry_session_cache = NULL;
+static struct kmem_cache *cry_key_cache = NULL;
+static struct kmem_cache *cry_msg_cache = NULL;
+static struct kmem_cache *cry_job_cache = NULL;
+
+/* Request queue of every possible CPU. */
+static DEFINE_PER_CPU(struct cry_queue *, cry_queues);
+/* Workqueue which the scheduler runs on. */
+static struct workqueue_struct *cry_wq = NULL;
+/* Status counters of every possible CPU. */
+static DEFINE_PER_CPU(struct cry_counters, cry_counters);
+/* Status page which is mapped to user space, the amount of its mappings and the work which updates it. */
+static struct cry_status *cryStatus = NULL;
+static atomic_t statusMaps = ATOMIC_INIT(0);
+static void cry_status_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(cry_status_work, cry_status_work_fn);
+/* Buffers retired since the last background wipe and the work which wipes them. */
+static LLIST_HEAD(cry_retired_list);
+static void cry_wipe_work_fn(struct work_struct *work);
+static DECLARE_WORK(cry_wipe_work, cry_wipe_work_fn);
 
 /* The basic device class. */
 static struct class *cryClass = NULL;
@@ -64,37 +299,169 @@ static ssize_t cry_write(struct file *, const char *, size_t, loff_t *);
 /* Ioctl is called when a process tries to do an ioctl call to the character device file. */
 static long cry_ioctl(struct file *file, unsigned int cmd_in,
 		      unsigned long arg);
+/* Mmap is called when a process maps the character device file to its memory. */
+static int cry_mmap(struct file *filep, struct vm_area_struct *vma);
+#ifdef CRY_HAVE_URING_CMD
+/* Uring_cmd is called when a process submits an io_uring command to the character device file. */
+static int cry_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags);
+#endif
 
 /* Linux file structure operations which the character device will support. */
 static struct file_operations fops = {
+	/* Open files and their mappings hold a reference to the module, so it is never unloaded under them. */
+	.owner = THIS_MODULE,
 	.open = cry_open,
 	.read = cry_read,
 	.write = cry_write,
 	.release = cry_release,
 	.unlocked_ioctl = cry_ioctl,
+	.mmap = cry_mmap,
+#ifdef CRY_HAVE_URING_CMD
+	.uring_cmd = cry_uring_cmd,
+#endif
+};
+
+/* RC4-state of a crypto API transform, which continues from request to request. */
+/* Requests may come from softirq context, so the lock disables the bottom halves. */
+struct cry_skcipher_ctx {
+	spinlock_t lock;
+	struct rc4_state state;
+};
+
+/* Function prototypes for the crypto API algorithm. */
+static int cry_skcipher_init(struct crypto_skcipher *tfm);
+static int cry_skcipher_setkey(struct crypto_skcipher *tfm, const u8 *key,
+			       unsigned int len);
+static int cry_skcipher_crypt(struct skcipher_request *req);
+
+/* RC4-cipher registered to the kernel crypto API. */
+/* Like ecb(arc4), the RC4-stream of a transform continues over its requests, so a message may be split to */
+/* several requests and no part of the stream is ever used twice. setkey starts the stream from the beginning. */
+static struct skcipher_alg cry_skcipher_alg = {
+	.base.cra_name = CRYPTO_ALG_NAME,
+	.base.cra_driver_name = CRYPTO_DRIVER_NAME,
+	.base.cra_priority = CRYPTO_PRIORITY,
+	.base.cra_blocksize = 1,
+	.base.cra_ctxsize = sizeof(struct cry_skcipher_ctx),
+	.base.cra_module = THIS_MODULE,
+	.min_keysize = 1,
+	.max_keysize = CRYPTO_KEY_MAX_SIZE,
+	.init = cry_skcipher_init,
+	.setkey = cry_skcipher_setkey,
+	.encrypt = cry_skcipher_crypt,
+	.decrypt = cry_skcipher_crypt,
 };
 
-/* Declare a mutex for making sure that multiple users don't use the device at same time. */
-static DEFINE_MUTEX(cry_device_lock);
-/* Declare a mutex for making sure that that writing and reading doesn't occur at same time. */
-static DEFINE_MUTEX(cry_readwrite_lock);
-/* Declare a mutex for making sure that at any time, only one operation can be running. */
-static DEFINE_MUTEX(cry_operation_lock);
+/* Function prototypes for the transform chain. */
+static int cry_set_chain(struct cry_session *session,
+			 const struct cry_chain *newChain);
+static void cry_reset_chain(struct cry_session *session);
+static void cry_transform(struct cry_job *job, size_t len);
+static void cry_transform_buf(struct cry_job *job, unsigned char *buf,
+			      size_t len);
+static void cry_transform_block(struct cry_job *job, unsigned char *buf,
+				size_t len);
 
-/* Function prototype for the rc4 based encryption. */
-void rc4(unsigned char *key, unsigned char *msg);
+/* Function prototypes for running the transform and the compression of a message. */
+static void cry_init_job(struct cry_job *job, struct cry_session *session);
+static void cry_complete_job(struct cry_job *job);
+static int cry_run_job(struct cry_session *session);
+static void cry_put_job(struct cry_session *session, struct cry_job *job);
+static bool cry_run_inline(struct cry_job *job);
+static int cry_read_lazy(struct cry_session *session, char *buffer, int len);
 
-/* Function prototype for function that safely clears any buffers. */
-void clear_buffer(unsigned char *buf, int bufsize);
+/* Function prototype for mapping the status page. */
+static int cry_mmap_status(struct vm_area_struct *vma);
+
+/* Function prototypes for the staging buffer. */
+static int cry_set_staging(struct cry_session *session, u64 size);
+static struct cry_staging *cry_alloc_staging(u64 size, unsigned int order);
+static void cry_free_staging(struct cry_staging *staging);
+static int cry_crypt_staging(struct cry_session *session, u64 offset, u64 len);
+static int cry_set_compress(struct cry_session *session, unsigned int mode);
+static void cry_compress(struct cry_session *session, int len);
+static int cry_decompress(struct cry_session *session);
+
+/* Function prototypes for the scheduler. */
+static int cry_create_queues(void);
+static void cry_destroy_queues(void);
+static void cry_sched_submit(struct cry_job *job);
+static bool cry_sched_cancel(struct cry_job *job);
+static void cry_sched_work_fn(struct work_struct *work);
+
+/* Function prototypes for the scheduler statistics in sysfs. */
+static ssize_t sched_queue_depth_show(struct device *dev,
+				      struct device_attribute *attr, char *buf);
+static ssize_t sched_wait_ns_show(struct device *dev,
+				  struct device_attribute *attr, char *buf);
+static DEVICE_ATTR_RO(sched_queue_depth);
+static DEVICE_ATTR_RO(sched_wait_ns);
+static struct attribute *cry_attrs[] = {
+	&dev_attr_sched_queue_depth.attr,
+	&dev_attr_sched_wait_ns.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(cry);
+
+/* Function prototypes for creating and destroying the caches and sessions. */
+static int cry_create_caches(void);
+static void cry_destroy_caches(void);
+static void cry_free_session(struct cry_session *session);
+
+/* Function prototypes for wiping the buffers. */
+static void cry_wipe_msg(struct cry_session *session);
+static void cry_retire_buffer(struct kmem_cache *cache, void *buf, size_t len);
 
 /* This function will be executed at module initialization time. */
 static int __init cry_init(void)
 {
+	int ret;
+
 	printk(KERN_INFO "hardcryptor: Starting Crypto-module as LKM.\n");
 
+	/* Create the caches which sessions and their buffers are allocated from. */
+	ret = cry_create_caches();
+	if (ret < 0) {
+		printk(KERN_ALERT "hardcryptor: Could not create the caches!\n");
+		return ret;
+	}
+
+	/* Create the request queues of the CPUs. */
+	ret = cry_create_queues();
+	if (ret < 0) {
+		cry_destroy_caches();
+		printk(KERN_ALERT "hardcryptor: Could not create the request queues!\n");
+		return ret;
+	}
+
+	/* Create the workqueue which the encryption work is scheduled on. */
+	/* Workqueue is bound to the CPUs, so the work of each queue runs on the CPU of the queue. */
+	cry_wq = alloc_workqueue("hardcryptor", 0, 0);
+	if (cry_wq == NULL) {
+		cry_destroy_queues();
+		cry_destroy_caches();
+		printk(KERN_ALERT "hardcryptor: Could not create the workqueue!\n");
+		return -ENOMEM;
+	}
+
+	/* Allocate the status page, which is zeroed so that nothing else is exposed to user space. */
+	cryStatus = (struct cry_status *)get_zeroed_page(GFP_KERNEL);
+	if (cryStatus == NULL) {
+		destroy_workqueue(cry_wq);
+		cry_destroy_queues();
+		cry_destroy_caches();
+		printk(KERN_ALERT "hardcryptor: Could not allocate the status page!\n");
+		return -ENOMEM;
+	}
+	cryStatus->version = CRY_STATUS_VERSION;
+
 	/* Register a character device and try to get a major number dynamically if possible. */
 	majorNum = register_chrdev(0, DEVICE_NAME, &fops);
 	if (majorNum < 0) {
+		free_page((unsigned long)cryStatus);
+		destroy_workqueue(cry_wq);
+		cry_destroy_queues();
+		cry_destroy_caches();
 		printk(KERN_ALERT
 		       "hardcryptor: Could not register a major number!\n");
 		return PTR_ERR(&majorNum);
@@ -103,47 +470,102 @@ static int __init cry_init(void)
 	       majorNum);
 
 	/* Create a struct class structure which will be used in creating the device. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+	cryClass = class_create(CLASS_NAME);
+#else
 	cryClass = class_create(THIS_MODULE, CLASS_NAME);
+#endif
 	if (IS_ERR(cryClass)) {
 		/* Unregister the character device as we could not create the device class. */
 		unregister_chrdev(majorNum, DEVICE_NAME);
+		free_page((unsigned long)cryStatus);
+		destroy_workqueue(cry_wq);
+		cry_destroy_queues();
+		cry_destroy_caches();
 		printk(KERN_ALERT
 		       "hardcryptor: Could not register the device class!\n");
 		return PTR_ERR(cryClass);
 	}
 	printk(KERN_INFO "hardcryptor: Registered the device class.\n");
 
-	/* Create a device and register it with sysfs. */
+	/* Create a device and register it and its scheduler statistics with sysfs. */
 	cryDevice =
-	    device_create(cryClass, NULL, MKDEV(majorNum, 0), NULL,
-			  DEVICE_NAME);
+	    device_create_with_groups(cryClass, NULL, MKDEV(majorNum, 0), NULL,
+				      cry_groups, DEVICE_NAME);
 	if (IS_ERR(cryDevice)) {
 		/* Destroy the class and unregister the character device as we could not create the device driver. */
 		class_destroy(cryClass);
 		unregister_chrdev(majorNum, DEVICE_NAME);
+		free_page((unsigned long)cryStatus);
+		destroy_workqueue(cry_wq);
+		cry_destroy_queues();
+		cry_destroy_caches();
 		printk(KERN_ALERT "hardcryptor: Could not create the device.\n");
 		return PTR_ERR(cryDevice);
 	}
 	printk(KERN_INFO "hardcryptor: Created the device to /dev/%s.\n",
 	       DEVICE_NAME);
 
+	/* Register the RC4-cipher so that it can be used through the crypto API and AF_ALG. */
+	ret = crypto_register_skcipher(&cry_skcipher_alg);
+	if (ret < 0) {
+		device_destroy(cryClass, MKDEV(majorNum, 0));
+		class_destroy(cryClass);
+		unregister_chrdev(majorNum, DEVICE_NAME);
+		free_page((unsigned long)cryStatus);
+		destroy_workqueue(cry_wq);
+		cry_destroy_queues();
+		cry_destroy_caches();
+		printk(KERN_ALERT
+		       "hardcryptor: Could not register the crypto algorithm.\n");
+		return ret;
+	}
+	printk(KERN_INFO "hardcryptor: Registered crypto algorithm %s.\n",
+	       CRYPTO_DRIVER_NAME);
+
 	return 0;
 }
 
 /* This function which will be executed on the module cleanup time. */
 static void __exit cry_exit(void)
 {
-	/* Destroy the device, destroy the class and unregister the character device. */
+	/* Unregister the crypto algorithm, destroy the device, destroy the class and unregister the character device. */
+	crypto_unregister_skcipher(&cry_skcipher_alg);
 	device_destroy(cryClass, MKDEV(majorNum, 0));
 	class_destroy(cryClass);
 	unregister_chrdev(majorNum, DEVICE_NAME);
+	/* Status page can't be mapped anymore, as no device file is open. */
+	cancel_delayed_work_sync(&cry_status_work);
+	free_page((unsigned long)cryStatus);
+	destroy_workqueue(cry_wq);
+	cry_destroy_queues();
+	cry_destroy_caches();
 	printk(KERN_INFO "hardcryptor: LKM unloaded successfully.\n");
 }
 
 /* This is called when the user tries to open the character device file. */
 static int cry_open(struct inode *inodep, struct file *filep)
 {
-	mutex_lock(&cry_device_lock);
+	struct cry_session *session;
+
+	/* Every user gets its own session, so multiple users can use the device at same time. */
+	session = kmem_cache_zalloc(cry_session_cache, GFP_KERNEL);
+	if (session == NULL) {
+		return -ENOMEM;
+	}
+	this_cpu_inc(cry_counters.sessions);
+	mutex_init(&session->lock);
+	session->weight = CRY_WEIGHT_DEFAULT;
+	INIT_LIST_HEAD(&session->jobs);
+	INIT_LIST_HEAD(&session->active);
+	session->encryptionKey = kmem_cache_zalloc(cry_key_cache, GFP_KERNEL);
+	session->msg = kmem_cache_zalloc(cry_msg_cache, GFP_KERNEL);
+	if (session->encryptionKey == NULL || session->msg == NULL) {
+		cry_free_session(session);
+		return -ENOMEM;
+	}
+	filep->private_data = session;
+
 	printk(KERN_DEBUG "hardcryptor: User opened the device.\n");
 	return 0;
 }
@@ -152,33 +574,39 @@ static int cry_open(struct inode *inodep, struct file *filep)
 static ssize_t
 cry_read(struct file *filep, char *buffer, size_t len, loff_t *offset)
 {
+	struct cry_session *session = filep->private_data;
 	int errorCount = 0;
-	int charcount = msgSize;
-	mutex_lock(&cry_operation_lock);
+	int charcount;
+	mutex_lock(&session->lock);
 
 	/* If length is specified and it is shorter than message size, use it. */
-	if (len > 0 && len < msgSize) {
+	charcount = session->msgSize;
+	if (len > 0 && len < session->msgSize) {
 		charcount = len;
 	}
 
-	/* Copy the saved message from the global variable to user space. */
+	/* Copy the saved message from the session to user space. */
 	/* If there were any errors, return an I/O Error. */
-	errorCount = copy_to_user(buffer, msg, charcount);
+	if (session->lazy) {
+		errorCount = cry_read_lazy(session, buffer, charcount);
+	} else {
+		errorCount = copy_to_user(buffer, session->msg, charcount);
+	}
 
 	/* Avoid possible information leaks by clearing the buffer. */
-	clear_buffer(msg, MESSAGE_MAX_SIZE);
+	cry_wipe_msg(session);
 
 	if (errorCount == 0) {
 		printk(KERN_DEBUG "hardcryptor: Sent %d characters to user.\n",
 		       charcount);
-		msgSize = 0;
-		mutex_unlock(&cry_operation_lock);
+		session->msgSize = 0;
+		mutex_unlock(&session->lock);
 		return charcount;
 	} else {
 		printk(KERN_DEBUG
 		       "hardcryptor: Could not send %d characters to user!\n",
 		       charcount);
-		mutex_unlock(&cry_operation_lock);
+		mutex_unlock(&session->lock);
 		return -EIO;
 	}
 }
@@ -187,33 +615,77 @@ cry_read(struct file *filep, char *buffer, size_t len, loff_t *offset)
 static ssize_t
 cry_write(struct file *filep, const char *buffer, size_t len, loff_t *offset)
 {
-	int charcount = MESSAGE_MAX_SIZE;
-	mutex_lock(&cry_operation_lock);
+	struct cry_session *session = filep->private_data;
+	int maxSize = MESSAGE_MAX_SIZE;
+	int charcount;
+	int ret;
+	mutex_lock(&session->lock);
 
 	/* If there is no encryption key, return an invalid argument error. */
-	if (strlen(encryptionKey) == 0) {
+	if (strlen(session->encryptionKey) == 0) {
 		printk(KERN_NOTICE
 		       "hardcryptor: User tried to write in the device when there was no encryption key present.\n");
-		mutex_unlock(&cry_operation_lock);
+		mutex_unlock(&session->lock);
 		return -EINVAL;
 	}
 
+	/* Compressed frames may be a bit bigger than the maximum message size. */
+	if (session->compress == CRY_DECOMPRESS_LZ4) {
+		maxSize = MESSAGE_BUF_SIZE;
+	}
+
 	/* If length is specified and it is shorter than maximum message size, use it. */
-	if (len > 0 && len < MESSAGE_MAX_SIZE) {
+	charcount = maxSize;
+	if (len > 0 && len < maxSize) {
 		charcount = len;
 	}
 
 	/* Write characters in input buffer to the message. */
-	snprintf(msg, charcount+1, "%s", buffer);
-	msgSize = charcount;
+	/* Data which will be compressed is written to the scratch buffer, and the frame is built to the message. */
+	if (session->compress == CRY_COMPRESS_LZ4) {
+		ret = copy_from_user(session->scratch, buffer, charcount);
+		if (ret != 0) {
+			/* Scratch buffer is kept clean between the messages. */
+			memzero_explicit(session->scratch, charcount);
+		}
+	} else {
+		session->msgDirty = max_t(short, session->msgDirty, charcount);
+		ret = copy_from_user(session->msg, buffer, charcount);
+	}
+	if (ret != 0) {
+		printk(KERN_NOTICE "hardcryptor: Could not copy the message from the user.\n");
+		mutex_unlock(&session->lock);
+		return -EFAULT;
+	}
+	session->msgSize = charcount;
 	printk(KERN_DEBUG "hardcryptor: Received %d characters to device!\n",
 	       charcount);
 
+	if (session->compress == CRY_COMPRESS_LZ4) {
+		cry_compress(session, charcount);
+	}
+
+	/* In the lazy mode the message is transformed by the reader. */
+	if (session->lazy) {
+		mutex_unlock(&session->lock);
+		return charcount;
+	}
+
 	/* Lets encrypt/decrypt the message. */
 	printk(KERN_DEBUG "hardcryptor: Encrypting/decrypting the message.\n");
-	rc4(encryptionKey, msg);
+	ret = cry_run_job(session);
+	if (ret == 0 && session->compress == CRY_DECOMPRESS_LZ4) {
+		ret = cry_decompress(session);
+	}
+	if (ret < 0) {
+		/* Avoid possible information leaks by clearing the buffer. */
+		cry_wipe_msg(session);
+		session->msgSize = 0;
+		mutex_unlock(&session->lock);
+		return ret;
+	}
 
-	mutex_unlock(&cry_operation_lock);
+	mutex_unlock(&session->lock);
 
 	/* Return the amount of characters that were encrypted/decrypted. */
 	return charcount;
@@ -223,10 +695,18 @@ cry_write(struct file *filep, const char *buffer, size_t len, loff_t *offset)
 static long
 cry_ioctl(struct file *file, unsigned int ioctl_cmd, unsigned long arg)
 {
+	struct cry_session *session = file->private_data;
 	int ret_val = 0;
 	int i = 0;
-        char buf[KEY_MAX_SIZE];
-	mutex_lock(&cry_operation_lock);
+	long keyLen = 0;
+	char *buf = NULL;
+	struct cry_chain newChain;
+	struct cry_csum csum;
+	__u32 weight;
+	__u32 mode;
+	__u64 size;
+	struct cry_range range;
+	mutex_lock(&session->lock);
 
 	/* Find out if the user wants to set or get the encryption key. */
 	switch (ioctl_cmd) {
@@ -238,19 +718,25 @@ cry_ioctl(struct file *file, unsigned int ioctl_cmd, unsigned long arg)
 			break;
 		}
 
-		ret_val =
-		    copy_from_user(buf, (char *)arg, KEY_MAX_SIZE);
-		if (ret_val > 0) {
+		/* New key is read to a buffer from the key cache instead of the stack. */
+		buf = kmem_cache_zalloc(cry_key_cache, GFP_KERNEL);
+		if (buf == NULL) {
+			ret_val = -ENOMEM;
+			break;
+		}
+		keyLen = strncpy_from_user(buf, (char *)arg, KEY_MAX_SIZE);
+		if (keyLen < 0) {
 			printk(KERN_NOTICE "hardcryptor: Could not parse encryption key sent by the user.\n");
 			ret_val = -EINVAL;
 			break;
 		}
-		if (strlen(buf) < KEY_MIN_SIZE) {
+		if (keyLen < KEY_MIN_SIZE) {
 			printk(KERN_NOTICE "hardcryptor: User tried to enter too short encryption key.\n");
                         ret_val = -EINVAL;
 			break;
 		}
-		if (strlen(buf) > KEY_MAX_SIZE) {
+		/* Key which fills the whole buffer has no room for the terminating null. */
+		if (keyLen >= KEY_MAX_SIZE) {
 			printk(KERN_NOTICE "hardcryptor: User tried to enter too long encryption key.\n");
                         ret_val = -EINVAL;
 			break;
@@ -258,7 +744,7 @@ cry_ioctl(struct file *file, unsigned int ioctl_cmd, unsigned long arg)
 
 		/* Make sure that user wrote only acceptable characters to the device. */
 		/* For example, any control characters are not allowed. */
-		for (i = 0; i < strlen(buf); i++) {
+		for (i = 0; i < keyLen; i++) {
 			if (isalnum(buf[i]) || isspace(buf[i]) || ispunct(buf[i])) {
 				continue;
 			}
@@ -266,29 +752,165 @@ cry_ioctl(struct file *file, unsigned int ioctl_cmd, unsigned long arg)
 			ret_val = -EPERM;
 			break;
 		}
+		if (ret_val != 0) {
+			break;
+		}
 
 		/* Avoid possible information leaks by clearing the message buffer. */
-		clear_buffer(msg, MESSAGE_MAX_SIZE);
+		cry_wipe_msg(session);
 
-		/* Finally, replace the old encryption key with the new one. */
-		strncpy(encryptionKey, buf, KEY_MAX_SIZE);
+		/* Finally, replace the old encryption key with the new one and prepare its RC4-state. */
+		swap(session->encryptionKey, buf);
+		rc4_key_setup(&session->keyState, session->encryptionKey, keyLen);
+		session->streamState = session->keyState;
 
 		printk(KERN_DEBUG
 		       "hardcryptor: User changed encryption key via IOCTL.\n");
 		break;
 	case CRY_IOC_GET_KEY:
-		if (strlen(encryptionKey) == 0) {
+		if (strlen(session->encryptionKey) == 0) {
 			printk(KERN_NOTICE "hardcryptor: User tried to get encryption key when none was set.\n");
 			ret_val = -EINVAL;
 			break;
 		}
 		/* Copy data from the encryption key variable (Kernel space) to user space. */
 		ret_val =
-		    copy_to_user((char *)arg, encryptionKey,
-				 sizeof(encryptionKey));
+		    copy_to_user((char *)arg, session->encryptionKey,
+				 KEY_MAX_SIZE);
 		printk(KERN_DEBUG
 		       "hardcryptor: Encryption key sent to user via IOCTL.\n");
 		break;
+	case CRY_IOC_SET_CHAIN:
+		if (copy_from_user(&newChain, (void *)arg, sizeof(newChain)) != 0) {
+			printk(KERN_NOTICE "hardcryptor: Could not parse transform chain sent by the user.\n");
+			ret_val = -EFAULT;
+			break;
+		}
+		/* Chain is used by the io_uring jobs which are still running. */
+		if (atomic_read(&session->pending) > 0) {
+			ret_val = -EBUSY;
+			break;
+		}
+		ret_val = cry_set_chain(session, &newChain);
+		if (ret_val == 0) {
+			/* Avoid possible information leaks by clearing the message buffer. */
+			cry_wipe_msg(session);
+			printk(KERN_DEBUG "hardcryptor: User changed transform chain via IOCTL.\n");
+		}
+		break;
+	case CRY_IOC_GET_CHAIN:
+		if (copy_to_user((void *)arg, &session->chain,
+				 sizeof(session->chain)) != 0) {
+			ret_val = -EFAULT;
+		}
+		break;
+	case CRY_IOC_SET_WEIGHT:
+		if (get_user(weight, (__u32 *)arg) != 0) {
+			ret_val = -EFAULT;
+			break;
+		}
+		if (weight < CRY_WEIGHT_MIN || weight > CRY_WEIGHT_MAX) {
+			printk(KERN_NOTICE "hardcryptor: User tried to set invalid scheduling weight.\n");
+			ret_val = -EINVAL;
+			break;
+		}
+		/* Like with nice values, only privileged users may get more than the default share. */
+		if (weight > CRY_WEIGHT_DEFAULT && !capable(CAP_SYS_NICE)) {
+			ret_val = -EPERM;
+			break;
+		}
+		/* Scheduler reads the weight without the session lock, new weight is used from the next turn. */
+		WRITE_ONCE(session->weight, weight);
+		printk(KERN_DEBUG "hardcryptor: User changed scheduling weight via IOCTL.\n");
+		break;
+	case CRY_IOC_GET_WEIGHT:
+		ret_val = put_user((__u32)session->weight, (__u32 *)arg);
+		break;
+	case CRY_IOC_SET_CSUM:
+		if (get_user(csum.flags, (__u32 *)arg) != 0) {
+			ret_val = -EFAULT;
+			break;
+		}
+		if (csum.flags & ~(CRY_CSUM_INPUT | CRY_CSUM_OUTPUT)) {
+			printk(KERN_NOTICE "hardcryptor: User tried to set invalid checksum flags.\n");
+			ret_val = -EINVAL;
+			break;
+		}
+		session->csum.flags = csum.flags;
+		session->csum.input = 0;
+		session->csum.output = 0;
+		break;
+	case CRY_IOC_SET_COMPRESS:
+		if (get_user(mode, (__u32 *)arg) != 0) {
+			ret_val = -EFAULT;
+			break;
+		}
+		ret_val = cry_set_compress(session, mode);
+		break;
+	case CRY_IOC_GET_COMPRESS:
+		ret_val = put_user((__u32)session->compress, (__u32 *)arg);
+		break;
+	case CRY_IOC_SET_LAZY:
+		if (get_user(mode, (__u32 *)arg) != 0) {
+			ret_val = -EFAULT;
+			break;
+		}
+		/* Compression needs the whole message at once, so it can't be done lazily. */
+		if (mode != 0 && session->compress != CRY_COMPRESS_NONE) {
+			ret_val = -EINVAL;
+			break;
+		}
+		/* Avoid transforming a stored message twice or not at all. */
+		cry_wipe_msg(session);
+		session->msgSize = 0;
+		session->lazy = mode != 0;
+		printk(KERN_DEBUG "hardcryptor: User changed lazy mode via IOCTL.\n");
+		break;
+	case CRY_IOC_GET_LAZY:
+		ret_val = put_user((__u32)session->lazy, (__u32 *)arg);
+		break;
+	case CRY_IOC_SET_STREAM:
+		if (get_user(mode, (__u32 *)arg) != 0) {
+			ret_val = -EFAULT;
+			break;
+		}
+		if (mode > 1) {
+			ret_val = -EINVAL;
+			break;
+		}
+		/* Stream is continued in the order the messages are written, io_uring jobs would race for it. */
+		if (atomic_read(&session->pending) > 0) {
+			ret_val = -EBUSY;
+			break;
+		}
+		session->stream = mode;
+		session->streamState = session->keyState;
+		printk(KERN_DEBUG "hardcryptor: User changed stream mode via IOCTL.\n");
+		break;
+	case CRY_IOC_GET_STREAM:
+		ret_val = put_user((__u32)session->stream, (__u32 *)arg);
+		break;
+	case CRY_IOC_SET_STAGING:
+		if (get_user(size, (__u64 *)arg) != 0) {
+			ret_val = -EFAULT;
+			break;
+		}
+		ret_val = cry_set_staging(session, size);
+		break;
+	case CRY_IOC_CRYPT_STAGING:
+		if (copy_from_user(&range, (void *)arg, sizeof(range)) != 0) {
+			ret_val = -EFAULT;
+			break;
+		}
+		ret_val = cry_crypt_staging(session, range.offset, range.len);
+		break;
+	case CRY_IOC_GET_CSUM:
+		/* Checksums are copied through the stack, as only the chain is whitelisted in the session cache. */
+		csum = session->csum;
+		if (copy_to_user((void *)arg, &csum, sizeof(csum)) != 0) {
+			ret_val = -EFAULT;
+		}
+		break;
 	default:
 		/* If invalid ioctl call is given, log the operation and return. */
 		ret_val = -EPERM;
@@ -298,18 +920,20 @@ cry_ioctl(struct file *file, unsigned int ioctl_cmd, unsigned long arg)
 		break;
 	}
 
-	mutex_unlock(&cry_operation_lock);
+	mutex_unlock(&session->lock);
+
+	/* Avoid possible information leaks by clearing the unused key buffer before returning it to the cache. */
+	/* Key buffers are zeroed when allocated, so only the characters of the key need to be cleared. */
+	if (buf != NULL) {
+		cry_retire_buffer(cry_key_cache, buf, strnlen(buf, KEY_MAX_SIZE));
+	}
 	return ret_val;
 }
 
 /* This is called when a process closes the character device file. */
 static int cry_release(struct inode *inodep, struct file *filep)
 {
-	/* Avoid possible information leaks by clearing the buffer. */
-        clear_buffer(msg, MESSAGE_MAX_SIZE);
-        clear_buffer(encryptionKey, KEY_MAX_SIZE);
-
-	mutex_unlock(&cry_device_lock);
+	cry_free_session(filep->private_data);
 	printk(KERN_INFO "hardcryptor: Device closed succesfully.\n");
 	return 0;
 }
@@ -318,60 +942,1209 @@ static int cry_release(struct inode *inodep, struct file *filep)
 module_init(cry_init);
 module_exit(cry_exit);
 
-void clear_buffer(unsigned char *buf, int bufsize) {
+/* Create the caches, buffers which are copied to and from user space are whitelisted for hardened usercopy. */
+static int cry_create_caches(void)
+{
+	cry_session_cache =
+	    kmem_cache_create_usercopy("hardcryptor_session",
+				       sizeof(struct cry_session), 0,
+				       SLAB_HWCACHE_ALIGN,
+				       offsetof(struct cry_session, chain),
+				       sizeof(struct cry_chain), NULL);
+	cry_key_cache =
+	    kmem_cache_create_usercopy("hardcryptor_key", KEY_MAX_SIZE, 0,
+				       SLAB_HWCACHE_ALIGN, 0, KEY_MAX_SIZE,
+				       NULL);
+	cry_msg_cache =
+	    kmem_cache_create_usercopy("hardcryptor_msg", MESSAGE_BUF_SIZE, 0,
+				       SLAB_HWCACHE_ALIGN, 0, MESSAGE_BUF_SIZE,
+				       NULL);
+	cry_job_cache =
+	    kmem_cache_create("hardcryptor_job", sizeof(struct cry_job), 0,
+			      SLAB_HWCACHE_ALIGN, NULL);
+	if (cry_session_cache == NULL || cry_key_cache == NULL
+	    || cry_msg_cache == NULL || cry_job_cache == NULL) {
+		cry_destroy_caches();
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/* Destroy the caches, all sessions must have been freed before this. */
+static void cry_destroy_caches(void)
+{
+	kmem_cache_destroy(cry_job_cache);
+	kmem_cache_destroy(cry_msg_cache);
+	kmem_cache_destroy(cry_key_cache);
+	kmem_cache_destroy(cry_session_cache);
+	cry_job_cache = NULL;
+	cry_msg_cache = NULL;
+	cry_key_cache = NULL;
+	cry_session_cache = NULL;
+}
+
+/* Free the session and its buffers back to the caches. */
+static void cry_free_session(struct cry_session *session)
+{
+	/* Avoid possible information leaks by clearing the buffers, only the parts which have been used. */
+	if (session->msg != NULL) {
+		cry_retire_buffer(cry_msg_cache, session->msg, session->msgDirty);
+	}
+	/* Scratch buffer is cleared after every use, so it is always clean here. */
+	if (session->scratch != NULL) {
+		kmem_cache_free(cry_msg_cache, session->scratch);
+	}
+	if (session->encryptionKey != NULL) {
+		cry_retire_buffer(cry_key_cache, session->encryptionKey,
+				  strnlen(session->encryptionKey, KEY_MAX_SIZE));
+	}
+	if (session->staging != NULL) {
+		cry_free_staging(session->staging);
+	}
+	cry_reset_chain(session);
+	mutex_destroy(&session->lock);
+	this_cpu_dec(cry_counters.sessions);
+	/* Session holds the RC4-state of the key. */
+	cry_retire_buffer(cry_session_cache, session, sizeof(*session));
+}
+
+/* Clear the part of the message buffer which has been used since it was last cleared. */
+static void cry_wipe_msg(struct cry_session *session)
+{
+	memzero_explicit(session->msg, session->msgDirty);
+	session->msgDirty = 0;
+}
+
+/* Clear the first len bytes of a buffer, which must be the only used part of it, and free it to its cache. */
+/* With deferWipe the buffer is queued and cleared later in a batch together with the other retired buffers. */
+/* Buffer is not returned to the cache before it has been cleared, so its contents never leak to a new owner. */
+static void cry_retire_buffer(struct kmem_cache *cache, void *buf, size_t len)
+{
+	struct cry_retired *retired = buf;
+
+	if (!READ_ONCE(deferWipe) || len == 0) {
+		memzero_explicit(buf, len);
+		kmem_cache_free(cache, buf);
+		return;
+	}
+
+	/* Header overwrites the start of the buffer, so it is cleared too. */
+	retired->cache = cache;
+	retired->len = max(len, sizeof(*retired));
+	if (llist_add(&retired->node, &cry_retired_list)) {
+		queue_work(cry_wq, &cry_wipe_work);
+	}
+}
+
+/* Clear the retired buffers and return them to their caches. */
+static void cry_wipe_work_fn(struct work_struct *work)
+{
+	struct llist_node *batch = llist_del_all(&cry_retired_list);
+	struct cry_retired *retired;
+	struct cry_retired *next;
+	struct kmem_cache *cache;
+
+	llist_for_each_entry_safe(retired, next, batch, node) {
+		cache = retired->cache;
+		memzero_explicit(retired, retired->len);
+		kmem_cache_free(cache, retired);
+	}
+}
+
+/* Prepare the lock of a new crypto API transform. */
+static int cry_skcipher_init(struct crypto_skcipher *tfm)
+{
+	struct cry_skcipher_ctx *ctx = crypto_skcipher_ctx(tfm);
+
+	spin_lock_init(&ctx->lock);
+	return 0;
+}
+
+/* Prepare the RC4-state for the key given through the crypto API. */
+static int cry_skcipher_setkey(struct crypto_skcipher *tfm, const u8 *key,
+			       unsigned int len)
+{
+	struct cry_skcipher_ctx *ctx = crypto_skcipher_ctx(tfm);
+
+	spin_lock_bh(&ctx->lock);
+	rc4_key_setup(&ctx->state, key, len);
+	spin_unlock_bh(&ctx->lock);
+	return 0;
+}
+
+/* Encrypt or decrypt a crypto API request by walking its scatterlists. */
+/* Requests of a transform are serialized, each one continues the RC4-stream where the previous one ended. */
+static int cry_skcipher_crypt(struct skcipher_request *req)
+{
+	struct crypto_skcipher *tfm = crypto_skcipher_reqtfm(req);
+	struct cry_skcipher_ctx *ctx = crypto_skcipher_ctx(tfm);
+	struct skcipher_walk walk;
+	int err;
+
+	/* Walk must not sleep while the lock is held. */
+	spin_lock_bh(&ctx->lock);
+	err = skcipher_walk_virt(&walk, req, true);
+	while (walk.nbytes > 0) {
+		if (walk.dst.virt.addr != walk.src.virt.addr) {
+			memcpy(walk.dst.virt.addr, walk.src.virt.addr,
+			       walk.nbytes);
+		}
+		rc4_crypt(&ctx->state, walk.dst.virt.addr, walk.nbytes);
+		this_cpu_add(cry_counters.bytes, walk.nbytes);
+		err = skcipher_walk_done(&walk, 0);
+	}
+	spin_unlock_bh(&ctx->lock);
+	this_cpu_inc(cry_counters.ops);
+	return err;
+}
+
+/* Validate the new transform chain and take it into use. */
+static int cry_set_chain(struct cry_session *session,
+			 const struct cry_chain *newChain)
+{
 	int i;
-	for(i = 0; i < bufsize; i++) {
-		buf[i] = 0;
+	int rc4Stages = 0;
+	int rotStages = 0;
+
+	if (newChain->count > CRY_CHAIN_MAX_STAGES) {
+		printk(KERN_NOTICE "hardcryptor: User tried to set too long transform chain.\n");
+		return -EINVAL;
+	}
+	for (i = 0; i < newChain->count; i++) {
+		switch (newChain->stages[i].type) {
+		case CRY_STAGE_RC4:
+			rc4Stages++;
+			break;
+		case CRY_STAGE_ROT:
+			rotStages++;
+			break;
+		default:
+			printk(KERN_NOTICE "hardcryptor: User tried to set invalid transform stage.\n");
+			return -EINVAL;
+		}
+	}
+	/* Single RC4-stream is shared by the whole chain, so it can be applied only once. */
+	if (rc4Stages > 1) {
+		printk(KERN_NOTICE "hardcryptor: User tried to set more than one RC4 stage.\n");
+		return -EINVAL;
+	}
+
+	/* Hold a reference to the rot module while its transform is in use. */
+	if (rotStages > 0 && session->rotTransform == NULL) {
+		session->rotTransform = symbol_get(rot_transform);
+		if (session->rotTransform == NULL) {
+			printk(KERN_NOTICE "hardcryptor: Rotation stage needs the rot module to be loaded.\n");
+			return -ENOENT;
+		}
+	} else if (rotStages == 0 && session->rotTransform != NULL) {
+		symbol_put(rot_transform);
+		session->rotTransform = NULL;
+	}
+
+	session->chain = *newChain;
+	return 0;
+}
+
+/* Return to the default chain and release the rot module. */
+static void cry_reset_chain(struct cry_session *session)
+{
+	session->chain.count = 0;
+	if (session->rotTransform != NULL) {
+		symbol_put(rot_transform);
+		session->rotTransform = NULL;
+	}
+}
+
+/* Prepare a job for transforming the message of the session. */
+static void cry_init_job(struct cry_job *job, struct cry_session *session)
+{
+	job->session = session;
+	job->buf = session->msg;
+	job->len = session->msgSize;
+	job->done = 0;
+	/* Every message starts from the beginning of the RC4-stream, unless the session is in the stream mode. */
+	job->state = session->stream ? session->streamState : session->keyState;
+	/* CRC32C is started with all ones, like in the standard CRC-32C. */
+	job->csum.flags = session->csum.flags;
+	job->csum.input = ~0;
+	job->csum.output = ~0;
+	job->finish = cry_complete_job;
+	job->queue = NULL;
+	init_completion(&job->completion);
+}
+
+/* Finish function of the jobs which are waited for, wakes up the waiter. */
+static void cry_complete_job(struct cry_job *job)
+{
+	complete(&job->completion);
+}
+
+/* Encrypt/decrypt the message of the session, queued to the scheduler only when other sessions compete for the CPU. */
+static int cry_run_job(struct cry_session *session)
+{
+	struct cry_job *job;
+
+	job = kmem_cache_alloc(cry_job_cache, GFP_KERNEL);
+	if (job == NULL) {
+		return -ENOMEM;
+	}
+	cry_init_job(job, session);
+	if (!cry_run_inline(job)) {
+		cry_sched_submit(job);
+		wait_for_completion(&job->completion);
+	}
+	cry_put_job(session, job);
+	return 0;
+}
+
+/* Take the checksums and the RC4-state of a finished job to the session and free the job. */
+static void cry_put_job(struct cry_session *session, struct cry_job *job)
+{
+	session->csum.input = ~job->csum.input;
+	session->csum.output = ~job->csum.output;
+	/* In the stream mode the next message continues from where this one ended. */
+	if (session->stream) {
+		session->streamState = job->state;
+	}
+
+	/* Avoid possible information leaks by clearing the RC4-state of the job. */
+	memzero_explicit(&job->state, sizeof(job->state));
+	kmem_cache_free(cry_job_cache, job);
+}
+
+/* Transform the whole job in the calling thread if the queue of the CPU has no active sessions. */
+/* Scheduling only matters under contention, on an idle queue it would just add a wakeup and two context switches. */
+/* Sessions whose weight was changed always go through the scheduler, so that the weight is honoured. */
+/* Must be called with the session lock held, so that no other job of the session can be queued meanwhile. */
+static bool cry_run_inline(struct cry_job *job)
+{
+	struct cry_session *session = job->session;
+	struct cry_queue *queue;
+	bool idle;
+
+	/* Pinned processing and sessions with queued io_uring jobs always go through the scheduler. */
+	if (READ_ONCE(schedCpu) >= 0 || atomic_read(&session->pending) > 0
+	    || READ_ONCE(session->weight) != CRY_WEIGHT_DEFAULT) {
+		return false;
+	}
+
+	queue = per_cpu(cry_queues, raw_smp_processor_id());
+	spin_lock(&queue->lock);
+	idle = list_empty(&queue->active);
+	if (idle) {
+		queue->stats[READ_ONCE(session->weight)].jobs++;
+	}
+	spin_unlock(&queue->lock);
+	if (!idle) {
+		return false;
+	}
+
+	cry_transform(job, job->len);
+	this_cpu_add(cry_counters.bytes, job->len);
+	this_cpu_inc(cry_counters.ops);
+	return true;
+}
+
+/* Transform the first len bytes of the stored message block by block right before copying them to the user. */
+/* Each block is transformed in place in the message, which is wiped after the read anyway, so no extra copy is made. */
+/* Transform is done by the reader instead of the scheduler. Returns the amount of bytes not copied. */
+static int cry_read_lazy(struct cry_session *session, char *buffer, int len)
+{
+	struct cry_job *job;
+	int offset;
+	int blockSize;
+	int ret = 0;
+
+	job = kmem_cache_alloc(cry_job_cache, GFP_KERNEL);
+	if (job == NULL) {
+		return len;
+	}
+	cry_init_job(job, session);
+
+	for (offset = 0; offset < len; offset += blockSize) {
+		blockSize = min_t(int, len - offset, LAZY_BLOCK_SIZE);
+		cry_transform_buf(job, session->msg + offset, blockSize);
+		if (copy_to_user(buffer + offset, session->msg + offset,
+				 blockSize) != 0) {
+			ret = len - offset;
+			break;
+		}
+	}
+	this_cpu_add(cry_counters.bytes, offset);
+	this_cpu_inc(cry_counters.ops);
+	/* Checksums and the stream mode cover the part of the message that was read. */
+	cry_put_job(session, job);
+	return ret;
+}
+
+/* Allocate a zeroed staging buffer of at least size bytes in chunks of the given page order. */
+/* Memory is charged to the memory cgroup of the caller, as every open file may hold a buffer. */
+static struct cry_staging *cry_alloc_staging(u64 size, unsigned int order)
+{
+	struct cry_staging *staging;
+	size_t chunkSize = PAGE_SIZE << order;
+	gfp_t gfp = GFP_KERNEL_ACCOUNT | __GFP_ZERO;
+	unsigned int i;
+
+	/* Higher orders fail fast, the caller falls back to a smaller order. */
+	if (order > 0) {
+		gfp |= __GFP_COMP | __GFP_NOWARN | __GFP_NORETRY;
+	}
+	size = round_up(size, chunkSize);
+	staging = kvzalloc(struct_size(staging, chunks, size / chunkSize),
+			   GFP_KERNEL_ACCOUNT);
+	if (staging == NULL) {
+		return NULL;
+	}
+	staging->size = size;
+	staging->order = order;
+	for (i = 0; i < size / chunkSize; i++) {
+		/* Zeroed memory, so nothing from the earlier users of the pages can be mapped. */
+		staging->chunks[i] = alloc_pages(gfp, order);
+		if (staging->chunks[i] == NULL) {
+			cry_free_staging(staging);
+			return NULL;
+		}
+		staging->count++;
+	}
+	return staging;
+}
+
+/* Replace the staging buffer of the session with a new one of the given size. */
+/* Buffer is made of the largest chunks up to STAGING_CHUNK_SIZE that fit the size and can be allocated. */
+static int cry_set_staging(struct cry_session *session, u64 size)
+{
+	struct cry_staging *staging = NULL;
+	int order = get_order(STAGING_CHUNK_SIZE);
+
+	if (size > CRY_STAGING_MAX_SIZE) {
+		return -EINVAL;
+	}
+	/* Pages of a mapped buffer can't be freed. */
+	if (atomic_read(&session->stagingMaps) > 0) {
+		return -EBUSY;
+	}
+
+	if (size > 0) {
+		while (order > 0 && (PAGE_SIZE << order) > size) {
+			order--;
+		}
+		for (; order >= 0 && staging == NULL; order--) {
+			staging = cry_alloc_staging(size, order);
+		}
+		if (staging == NULL) {
+			printk(KERN_NOTICE "hardcryptor: Could not allocate staging buffer of %llu bytes.\n",
+			       size);
+			return -ENOMEM;
+		}
+		size = staging->size;
+	}
+
+	if (session->staging != NULL) {
+		cry_free_staging(session->staging);
+	}
+	session->staging = staging;
+	printk(KERN_DEBUG "hardcryptor: User changed staging buffer size to %llu via IOCTL.\n",
+	       size);
+	return 0;
+}
+
+/* Wipe and free the staging buffer. */
+static void cry_free_staging(struct cry_staging *staging)
+{
+	unsigned int i;
+
+	for (i = 0; i < staging->count; i++) {
+		memzero_explicit(page_address(staging->chunks[i]),
+				 PAGE_SIZE << staging->order);
+		__free_pages(staging->chunks[i], staging->order);
+	}
+	kvfree(staging);
+}
+
+/* Encrypt/decrypt a range of the staging buffer in place as a single message. */
+/* Range is transformed a chunk at a time, the RC4-stream and checksums continue from chunk to chunk. */
+/* Caller can be killed while it waits, the rest of the range is then left as it is and -EINTR is returned. */
+static int cry_crypt_staging(struct cry_session *session, u64 offset, u64 len)
+{
+	struct cry_staging *staging = session->staging;
+	struct cry_job *job;
+	size_t chunkSize;
+	size_t inChunk;
+	size_t segment;
+
+	if (staging == NULL || len == 0 || offset > staging->size
+	    || len > staging->size - offset) {
+		return -EINVAL;
+	}
+	if (strlen(session->encryptionKey) == 0) {
+		return -EINVAL;
+	}
+
+	job = kmem_cache_alloc(cry_job_cache, GFP_KERNEL);
+	if (job == NULL) {
+		return -ENOMEM;
+	}
+	cry_init_job(job, session);
+
+	chunkSize = PAGE_SIZE << staging->order;
+	while (len > 0) {
+		inChunk = offset & (chunkSize - 1);
+		segment = min_t(u64, len, chunkSize - inChunk);
+		job->buf = (unsigned char *)page_address(staging->chunks[offset / chunkSize]) + inChunk;
+		job->len = segment;
+		job->done = 0;
+		reinit_completion(&job->completion);
+
+		cry_sched_submit(job);
+		if (wait_for_completion_killable(&job->completion) != 0) {
+			/* Segment which the scheduler is transforming is finished, it is at most one chunk. */
+			if (!cry_sched_cancel(job)) {
+				wait_for_completion(&job->completion);
+			}
+			/* Avoid possible information leaks by clearing the RC4-state of the job. */
+			memzero_explicit(&job->state, sizeof(job->state));
+			kmem_cache_free(cry_job_cache, job);
+			return -EINTR;
+		}
+		offset += segment;
+		len -= segment;
+	}
+	cry_put_job(session, job);
+	return 0;
+}
+
+/* Mapping of the staging buffer is copied, e.g. on fork. */
+static void cry_vma_open(struct vm_area_struct *vma)
+{
+	struct cry_session *session = vma->vm_private_data;
+
+	atomic_inc(&session->stagingMaps);
+}
+
+/* Mapping of the staging buffer is removed. */
+static void cry_vma_close(struct vm_area_struct *vma)
+{
+	struct cry_session *session = vma->vm_private_data;
+
+	atomic_dec(&session->stagingMaps);
+}
+
+static const struct vm_operations_struct cry_vm_ops = {
+	.open = cry_vma_open,
+	.close = cry_vma_close,
+};
+
+/* Mapping of the status page is created or copied, the page is kept up to date while it is mapped. */
+static void cry_status_vma_open(struct vm_area_struct *vma)
+{
+	atomic_inc(&statusMaps);
+	schedule_delayed_work(&cry_status_work, 0);
+}
+
+/* Mapping of the status page is removed, the status work stops after the last one. */
+static void cry_status_vma_close(struct vm_area_struct *vma)
+{
+	atomic_dec(&statusMaps);
+}
+
+static const struct vm_operations_struct cry_status_vm_ops = {
+	.open = cry_status_vma_open,
+	.close = cry_status_vma_close,
+};
+
+/* Map the status page read-only, it can't be made writable later with mprotect either. */
+static int cry_mmap_status(struct vm_area_struct *vma)
+{
+	int ret;
+
+	if (vma->vm_end - vma->vm_start != PAGE_SIZE) {
+		return -EINVAL;
+	}
+	if (vma->vm_flags & VM_WRITE) {
+		return -EPERM;
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+	ret = remap_pfn_range(vma, vma->vm_start,
+			      virt_to_phys(cryStatus) >> PAGE_SHIFT, PAGE_SIZE,
+			      vma->vm_page_prot);
+	if (ret < 0) {
+		return ret;
+	}
+	vma->vm_ops = &cry_status_vm_ops;
+	cry_status_vma_open(vma);
+	return 0;
+}
+
+/* Fold the counters of all CPUs into the status page. */
+/* Data path only touches the counters of its own CPU, all the summing is done here. */
+static void cry_status_work_fn(struct work_struct *work)
+{
+	struct cry_counters *counters;
+	u64 bytes = 0;
+	u64 ops = 0;
+	long queued = 0;
+	long sessions = 0;
+	int pinned = READ_ONCE(schedCpu);
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		counters = per_cpu_ptr(&cry_counters, cpu);
+		bytes += READ_ONCE(counters->bytes);
+		ops += READ_ONCE(counters->ops);
+		queued += READ_ONCE(counters->queued);
+		sessions += READ_ONCE(counters->sessions);
+	}
+
+	/* Readers retry while the lock is odd or changes during their read. */
+	WRITE_ONCE(cryStatus->lock, cryStatus->lock + 1);
+	smp_wmb();
+	cryStatus->bytes = bytes;
+	cryStatus->ops = ops;
+	/* Counters of different CPUs are read at slightly different times. */
+	cryStatus->queued = max(queued, 0L);
+	cryStatus->sessions = max(sessions, 0L);
+	cryStatus->path = pinned < 0 ? CRY_PATH_LOCAL_CPU : CRY_PATH_PINNED_CPU;
+	cryStatus->pathCpu = pinned;
+	cryStatus->updatedNs = ktime_get_ns();
+	smp_wmb();
+	WRITE_ONCE(cryStatus->lock, cryStatus->lock + 1);
+
+	if (atomic_read(&statusMaps) > 0) {
+		schedule_delayed_work(&cry_status_work,
+				      msecs_to_jiffies(max(READ_ONCE(statusInterval), 1U)));
+	}
+}
+
+/* This is called when a process maps the character device file to its memory. */
+/* Staging buffer is mapped at offset 0, chunk by chunk, so no page faults are taken later. */
+static int cry_mmap(struct file *filep, struct vm_area_struct *vma)
+{
+	struct cry_session *session = filep->private_data;
+	struct cry_staging *staging;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long chunkSize;
+	unsigned long mapped;
+	unsigned int i;
+	int ret = 0;
+
+	if (vma->vm_pgoff == CRY_STATUS_OFFSET >> PAGE_SHIFT) {
+		return cry_mmap_status(vma);
+	}
+	if (vma->vm_pgoff != 0) {
+		return -EINVAL;
+	}
+
+	/* Pages are inserted straight to the mapping, so a private mapping would have nothing to copy on write. */
+	if (!(vma->vm_flags & VM_SHARED)) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&session->lock);
+	staging = session->staging;
+	if (staging == NULL || size > staging->size) {
+		mutex_unlock(&session->lock);
+		return -EINVAL;
+	}
+
+	chunkSize = PAGE_SIZE << staging->order;
+	for (i = 0, mapped = 0; mapped < size; i++, mapped += chunkSize) {
+		ret = remap_pfn_range(vma, vma->vm_start + mapped,
+				      page_to_pfn(staging->chunks[i]),
+				      min(chunkSize, size - mapped),
+				      vma->vm_page_prot);
+		if (ret < 0) {
+			/* Remove the chunks which were already mapped. */
+			if (mapped > 0) {
+				zap_vma_ptes(vma, vma->vm_start, mapped);
+			}
+			break;
+		}
+	}
+	if (ret == 0) {
+		vma->vm_private_data = session;
+		vma->vm_ops = &cry_vm_ops;
+		cry_vma_open(vma);
+	}
+	mutex_unlock(&session->lock);
+	return ret;
+}
+
+/* Change the compression mode and allocate the buffers it needs. */
+static int cry_set_compress(struct cry_session *session, unsigned int mode)
+{
+	if (mode != CRY_COMPRESS_NONE && mode != CRY_COMPRESS_LZ4
+	    && mode != CRY_DECOMPRESS_LZ4) {
+		printk(KERN_NOTICE "hardcryptor: User tried to set invalid compression mode.\n");
+		return -EINVAL;
+	}
+	if (mode != CRY_COMPRESS_NONE && session->lazy) {
+		return -EINVAL;
+	}
+	if (mode != CRY_COMPRESS_NONE && session->scratch == NULL) {
+		session->scratch = kmem_cache_zalloc(cry_msg_cache, GFP_KERNEL);
+		if (session->scratch == NULL) {
+			return -ENOMEM;
+		}
+	}
+	session->compress = mode;
+	printk(KERN_DEBUG "hardcryptor: User changed compression mode via IOCTL.\n");
+	return 0;
+}
+
+/* Compress len bytes of data from the scratch buffer into a frame in the message buffer. */
+static void cry_compress(struct cry_session *session, int len)
+{
+	struct cry_frame *frame = (struct cry_frame *)session->msg;
+	char *payload = session->msg + sizeof(*frame);
+	struct cry_queue **queue;
+	int size;
+
+	/* Work memory of the CPU is used, preemption stays disabled until the compressor is done with it. */
+	queue = get_cpu_ptr(&cry_queues);
+	size = LZ4_compress_default(session->scratch, payload, len,
+				    MESSAGE_BUF_SIZE - sizeof(*frame),
+				    (*queue)->lz4Workmem);
+	put_cpu_ptr(&cry_queues);
+	/* Data which doesn't get smaller is stored as is. */
+	if (size <= 0 || size >= len) {
+		memcpy(payload, session->scratch, len);
+		size = len;
+	}
+	frame->originalSize = cpu_to_le32(len);
+	frame->compressedSize = cpu_to_le32(size);
+	session->msgSize = sizeof(*frame) + size;
+	session->msgDirty = max(session->msgDirty, session->msgSize);
+
+	/* Avoid possible information leaks by clearing the uncompressed data. */
+	memzero_explicit(session->scratch, len);
+}
+
+/* Decompress the frame in the message buffer, the message buffer will contain the original data. */
+static int cry_decompress(struct cry_session *session)
+{
+	struct cry_frame *frame = (struct cry_frame *)session->msg;
+	char *payload = session->msg + sizeof(*frame);
+	u32 originalSize;
+	u32 compressedSize;
+	int size;
+
+	/* Frame which doesn't match its header was corrupted or decrypted with a wrong key. */
+	if (session->msgSize < sizeof(*frame)) {
+		return -EINVAL;
+	}
+	originalSize = le32_to_cpu(frame->originalSize);
+	compressedSize = le32_to_cpu(frame->compressedSize);
+	if (originalSize > MESSAGE_MAX_SIZE
+	    || compressedSize != session->msgSize - sizeof(*frame)) {
+		printk(KERN_NOTICE "hardcryptor: User wrote invalid compressed frame.\n");
+		return -EINVAL;
+	}
+
+	if (compressedSize == originalSize) {
+		memcpy(session->scratch, payload, originalSize);
+	} else {
+		size = LZ4_decompress_safe(payload, session->scratch,
+					   compressedSize, originalSize);
+		if (size != originalSize) {
+			/* Decompressor doesn't write past the original size. */
+			memzero_explicit(session->scratch, originalSize);
+			printk(KERN_NOTICE "hardcryptor: Could not decompress the frame.\n");
+			return -EINVAL;
+		}
 	}
+
+	/* Original data becomes the message and the frame is cleared from the old message buffer. */
+	cry_wipe_msg(session);
+	swap(session->msg, session->scratch);
+	session->msgSize = originalSize;
+	session->msgDirty = originalSize;
+	return 0;
+}
+
+/* Apply the transform chain to the next len bytes of the message in place. */
+/* Message is walked once: every stage is applied to a small block before moving to the next one. */
+/* RC4-state lives in the job, so the hot path doesn't need any large stack buffers. */
+static void cry_transform(struct cry_job *job, size_t len)
+{
+	unsigned char *buf = job->buf + job->done;
+
+	job->done += len;
+	cry_transform_buf(job, buf, len);
 }
 
-/*
-    Following public domain RC4-implementation is from
-    https://github.com/B-Con/crypto-algorithms
-*/
+/* Apply the transform chain of the job to a buffer in place, continuing from the state of the job. */
+static void cry_transform_buf(struct cry_job *job, unsigned char *buf,
+			      size_t len)
+{
+	struct cry_session *session = job->session;
+	struct cry_chain *chain = &session->chain;
+	size_t offset;
+	size_t blockSize;
+
+	if (chain->count == 0 && job->csum.flags == 0) {
+		rc4_crypt(&job->state, buf, len);
+		return;
+	}
+
+	/* Checksums are computed from each block while it is in the cache, so data is read only once. */
+	for (offset = 0; offset < len; offset += blockSize) {
+		blockSize = min_t(size_t, len - offset, CHAIN_BLOCK_SIZE);
+		if (job->csum.flags & CRY_CSUM_INPUT) {
+			job->csum.input =
+			    crc32c(job->csum.input, buf + offset, blockSize);
+		}
+		cry_transform_block(job, buf + offset, blockSize);
+		if (job->csum.flags & CRY_CSUM_OUTPUT) {
+			job->csum.output =
+			    crc32c(job->csum.output, buf + offset, blockSize);
+		}
+	}
+}
 
-void rc4_key_setup(unsigned char state[], const unsigned char key[], int len)
+/* Apply all stages of the transform chain to a single block. */
+static void cry_transform_block(struct cry_job *job, unsigned char *buf,
+				size_t len)
 {
+	struct cry_session *session = job->session;
+	struct cry_chain *chain = &session->chain;
 	int i;
-	int j;
 
-	for (i = 0; i < 256; ++i)
-		state[i] = i;
-	for (i = 0, j = 0; i < 256; ++i) {
-		unsigned char t = state[i];
+	if (chain->count == 0) {
+		rc4_crypt(&job->state, buf, len);
+		return;
+	}
+	for (i = 0; i < chain->count; i++) {
+		if (chain->stages[i].type == CRY_STAGE_RC4) {
+			rc4_crypt(&job->state, buf, len);
+		} else {
+			session->rotTransform((char *)buf, len,
+					      chain->stages[i].arg);
+		}
+	}
+}
+
+/* Allocate the request queue of every possible CPU from the memory of the CPU's node. */
+static int cry_create_queues(void)
+{
+	struct cry_queue *queue;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		queue = kzalloc_node(sizeof(*queue), GFP_KERNEL,
+				     cpu_to_node(cpu));
+		if (queue == NULL) {
+			cry_destroy_queues();
+			return -ENOMEM;
+		}
+		spin_lock_init(&queue->lock);
+		INIT_LIST_HEAD(&queue->active);
+		INIT_WORK(&queue->work, cry_sched_work_fn);
+		queue->cpu = cpu;
+		per_cpu(cry_queues, cpu) = queue;
+
+		queue->lz4Workmem = kvmalloc_node(LZ4_MEM_COMPRESS, GFP_KERNEL,
+						  cpu_to_node(cpu));
+		if (queue->lz4Workmem == NULL) {
+			cry_destroy_queues();
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+/* Free the request queues, the workqueue must be destroyed before this. */
+static void cry_destroy_queues(void)
+{
+	struct cry_queue *queue;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		queue = per_cpu(cry_queues, cpu);
+		if (queue == NULL) {
+			continue;
+		}
+		kvfree(queue->lz4Workmem);
+		kfree(queue);
+		per_cpu(cry_queues, cpu) = NULL;
+	}
+}
+
+/* Queue the job to the queue of the current CPU and make sure the scheduler of the queue is running. */
+/* Must be called with the session lock held, so that only one submitter picks the queue of the session. */
+static void cry_sched_submit(struct cry_job *job)
+{
+	struct cry_session *session = job->session;
+	struct cry_queue *queue;
+	int cpu = READ_ONCE(schedCpu);
+
+	/* Session which already has jobs keeps using their queue. */
+	if (atomic_inc_return(&session->pending) > 1) {
+		queue = session->queue;
+	} else {
+		/* Queue of the writing CPU is used unless the processing is pinned to an online CPU. */
+		if (cpu < 0 || cpu >= nr_cpu_ids || !cpu_online(cpu)) {
+			cpu = raw_smp_processor_id();
+		}
+		queue = per_cpu(cry_queues, cpu);
+		session->queue = queue;
+	}
+
+	this_cpu_inc(cry_counters.queued);
+	job->queuedAt = ktime_get_ns();
+	spin_lock(&queue->lock);
+	WRITE_ONCE(job->queue, queue);
+	job->weightClass = READ_ONCE(session->weight);
+	queue->stats[job->weightClass].depth++;
+	list_add_tail(&job->node, &session->jobs);
+	if (list_empty(&session->active)) {
+		list_add_tail(&session->active, &queue->active);
+	}
+	spin_unlock(&queue->lock);
+
+	queue_work_on(queue->cpu, cry_wq, &queue->work);
+}
+
+/* Take a queued job off its queue unless the scheduler is transforming it or it's already finished. */
+/* Returns true if the job was taken off, after which the scheduler doesn't touch it anymore. */
+static bool cry_sched_cancel(struct cry_job *job)
+{
+	struct cry_session *session = job->session;
+	struct cry_queue *queue = READ_ONCE(job->queue);
+
+	/* Job has not been queued yet. */
+	if (queue == NULL) {
+		return false;
+	}
+
+	spin_lock(&queue->lock);
+	if (job->done == job->len || queue->running == job) {
+		spin_unlock(&queue->lock);
+		return false;
+	}
+	list_del(&job->node);
+	queue->stats[job->weightClass].depth--;
+	this_cpu_dec(cry_counters.queued);
+	if (list_empty(&session->jobs)) {
+		list_del_init(&session->active);
+		session->deficit = 0;
+	}
+	smp_mb__before_atomic();
+	atomic_dec(&session->pending);
+	spin_unlock(&queue->lock);
+	return true;
+}
+
+/* Scheduler which processes the queued jobs of a CPU with deficit round robin over the sessions. */
+/* On its turn a session may process quantum times its weight bytes, after which it moves to the */
+/* end of the line. Large messages are processed in slices, so small ones never wait for long. */
+static void cry_sched_work_fn(struct work_struct *work)
+{
+	struct cry_queue *queue = container_of(work, struct cry_queue, work);
+	struct cry_session *session;
+	struct cry_job *job;
+	struct cry_job *finished;
+	long quantum;
+	size_t slice;
+
+	spin_lock(&queue->lock);
+	while (!list_empty(&queue->active)) {
+		session = list_first_entry(&queue->active,
+					   struct cry_session, active);
+		job = list_first_entry(&session->jobs, struct cry_job, node);
+
+		/* Session which starts its turn gets new credit. */
+		if (session->deficit <= 0) {
+			quantum = max_t(long, READ_ONCE(schedQuantum), 1);
+			session->deficit += quantum * READ_ONCE(session->weight);
+		}
+		if (job->done == 0) {
+			queue->stats[job->weightClass].jobs++;
+			queue->stats[job->weightClass].waitNs +=
+			    ktime_get_ns() - job->queuedAt;
+		}
+		slice = min_t(size_t, job->len - job->done, session->deficit);
+		queue->running = job;
+		spin_unlock(&queue->lock);
+
+		cry_transform(job, slice);
+		this_cpu_add(cry_counters.bytes, slice);
+
+		spin_lock(&queue->lock);
+		queue->running = NULL;
+		session->deficit -= slice;
+		finished = NULL;
+		if (job->done == job->len) {
+			list_del(&job->node);
+			queue->stats[job->weightClass].depth--;
+			this_cpu_dec(cry_counters.queued);
+			this_cpu_inc(cry_counters.ops);
+			finished = job;
+		}
+		if (list_empty(&session->jobs)) {
+			list_del_init(&session->active);
+			session->deficit = 0;
+		} else if (session->deficit <= 0) {
+			list_move_tail(&session->active, &queue->active);
+		}
+		/* Session may go away or move to another queue as soon as its last job is finished, */
+		/* so it's not touched after this. */
+		if (finished != NULL) {
+			smp_mb__before_atomic();
+			atomic_dec(&session->pending);
+			finished->finish(finished);
+		}
+		spin_unlock(&queue->lock);
+
+		cond_resched();
+		spin_lock(&queue->lock);
+	}
+	spin_unlock(&queue->lock);
+}
+
+#ifdef CRY_HAVE_URING_CMD
+/* Data of an io_uring command which is kept in the command while its job is running. */
+struct cry_uring_pdu {
+	struct cry_job *job;
+	void __user *addr;
+};
+
+/* Task work of the io_uring commands takes the issue flags from 6.4 on and a task work token from 6.18 on. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 18, 0)
+#define CRY_URING_TW_PARAMS struct io_uring_cmd *ioucmd, io_tw_token_t tw
+#define CRY_URING_TW_FLAGS IO_URING_CMD_TASK_WORK_ISSUE_FLAGS
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+#define CRY_URING_TW_PARAMS struct io_uring_cmd *ioucmd, unsigned int issue_flags
+#define CRY_URING_TW_FLAGS issue_flags
+#else
+#define CRY_URING_TW_PARAMS struct io_uring_cmd *ioucmd
+#define CRY_URING_TW_FLAGS 0
+#endif
+
+/* Function prototypes for completing the io_uring commands. */
+static void cry_uring_finish(struct cry_job *job);
+static void cry_uring_task_cb(CRY_URING_TW_PARAMS);
+static void cry_uring_free_job(struct cry_job *job);
+static void cry_uring_done(struct io_uring_cmd *ioucmd, ssize_t ret, u64 res2,
+			   unsigned int issue_flags);
+#ifdef CRY_HAVE_URING_CANCEL
+static void cry_uring_cancel(struct io_uring_cmd *ioucmd,
+			     unsigned int issue_flags);
+#endif
+
+/* This is called when a process submits an io_uring command to the character device file. */
+/* Buffer is copied in and the job is queued to the scheduler, the command completes when the job is done. */
+static int cry_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+	struct cry_session *session = ioucmd->file->private_data;
+	struct cry_uring_pdu *pdu = (struct cry_uring_pdu *)ioucmd->pdu;
+	const struct cry_uring_cmd *cmd;
+	struct cry_job *job;
+	unsigned char *buf;
+	bool nonblock = issue_flags & IO_URING_F_NONBLOCK;
+	gfp_t gfp = nonblock ? GFP_NOWAIT : GFP_KERNEL;
+	u64 addr;
+	u32 len;
+
+#ifdef CRY_HAVE_URING_CANCEL
+	/* Ring of a queued command is being torn down. */
+	if (issue_flags & IO_URING_F_CANCEL) {
+		cry_uring_cancel(ioucmd, issue_flags);
+		return 0;
+	}
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+	cmd = io_uring_sqe_cmd(ioucmd->sqe);
+#else
+	cmd = ioucmd->cmd;
+#endif
+	if (ioucmd->cmd_op != CRY_URING_CMD_CRYPT) {
+		return -ENOTTY;
+	}
+	/* Submission is shared with user space, so every field is read only once. */
+	addr = READ_ONCE(cmd->addr);
+	len = READ_ONCE(cmd->len);
+	if (len == 0 || len > MESSAGE_MAX_SIZE) {
+		return -EINVAL;
+	}
+
+	/* Submitter must not sleep, io_uring retries the command from a worker which may. */
+	if (nonblock) {
+		if (!mutex_trylock(&session->lock)) {
+			return -EAGAIN;
+		}
+	} else {
+		mutex_lock(&session->lock);
+	}
+
+	/* If there is no encryption key, return an invalid argument error. */
+	/* Commands complete in any order, so they can't continue the stream of the stream mode. */
+	if (strlen(session->encryptionKey) == 0 || session->stream) {
+		mutex_unlock(&session->lock);
+		return -EINVAL;
+	}
+
+	job = kmem_cache_alloc(cry_job_cache, gfp);
+	buf = kmem_cache_alloc(cry_msg_cache, gfp);
+	if (job == NULL || buf == NULL) {
+		mutex_unlock(&session->lock);
+		if (buf != NULL) {
+			kmem_cache_free(cry_msg_cache, buf);
+		}
+		if (job != NULL) {
+			kmem_cache_free(cry_job_cache, job);
+		}
+		return nonblock ? -EAGAIN : -ENOMEM;
+	}
+	if (copy_from_user(buf, u64_to_user_ptr(addr), len) != 0) {
+		mutex_unlock(&session->lock);
+		cry_retire_buffer(cry_msg_cache, buf, len);
+		kmem_cache_free(cry_job_cache, job);
+		return -EFAULT;
+	}
+
+	/* Job has its own buffer, the message buffer of the session is left for the writes. */
+	cry_init_job(job, session);
+	job->buf = buf;
+	job->len = len;
+	job->finish = cry_uring_finish;
+	job->priv = ioucmd;
+	pdu->job = job;
+	pdu->addr = u64_to_user_ptr(addr);
 
-		j = (j + state[i] + key[i % len]) % 256;
-		state[i] = state[j];
-		state[j] = t;
+#ifdef CRY_HAVE_URING_CANCEL
+	/* Command is made cancelable before its job is queued, so the job can't complete before that. */
+	io_uring_cmd_mark_cancelable(ioucmd, issue_flags);
+#endif
+	cry_sched_submit(job);
+	mutex_unlock(&session->lock);
+	return -EIOCBQUEUED;
+}
+
+/* Finish function of the io_uring jobs, result is copied to the user in the context of the submitter. */
+static void cry_uring_finish(struct cry_job *job)
+{
+	io_uring_cmd_complete_in_task(job->priv, cry_uring_task_cb);
+}
+
+/* Copy the transformed buffer to the user and complete the io_uring command. */
+static void cry_uring_task_cb(CRY_URING_TW_PARAMS)
+{
+	struct cry_uring_pdu *pdu = (struct cry_uring_pdu *)ioucmd->pdu;
+	struct cry_job *job = pdu->job;
+	ssize_t ret = job->len;
+	u64 res2;
+
+	/* Task work of an exiting submitter may run without its memory, so the result is dropped. */
+	if (current->flags & (PF_EXITING | PF_KTHREAD)) {
+		ret = -ECANCELED;
+	} else if (copy_to_user(pdu->addr, job->buf, job->len) != 0) {
+		ret = -EFAULT;
 	}
+	res2 = ((u64)~job->csum.input << 32) | (u32)~job->csum.output;
+
+	cry_uring_free_job(job);
+	cry_uring_done(ioucmd, ret, res2, CRY_URING_TW_FLAGS);
+}
+
+/* Free the job of an io_uring command. */
+static void cry_uring_free_job(struct cry_job *job)
+{
+	/* Avoid possible information leaks by clearing the buffer and the RC4-state of the job. */
+	cry_retire_buffer(cry_msg_cache, job->buf, job->len);
+	memzero_explicit(&job->state, sizeof(job->state));
+	kmem_cache_free(cry_job_cache, job);
 }
 
-void rc4_generate_stream(unsigned char state[], unsigned char out[], size_t len)
+/* Complete the io_uring command, with the checksums in the extra result of big completions. */
+static void cry_uring_done(struct io_uring_cmd *ioucmd, ssize_t ret, u64 res2,
+			   unsigned int issue_flags)
 {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 18, 0)
+	io_uring_cmd_done32(ioucmd, ret, res2, issue_flags);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+	io_uring_cmd_done(ioucmd, ret, res2, issue_flags);
+#else
+	io_uring_cmd_done(ioucmd, ret, res2);
+#endif
+}
+
+#ifdef CRY_HAVE_URING_CANCEL
+/* Cancel the command if its job is still waiting in the queue, called with the ring locked. */
+/* Jobs which are being transformed, already finished or not queued yet complete on their own, and io_uring waits for them. */
+/* Job is only freed by its task work or here, both with the ring locked, so it's valid while the command is cancelable. */
+static void cry_uring_cancel(struct io_uring_cmd *ioucmd,
+			     unsigned int issue_flags)
+{
+	struct cry_uring_pdu *pdu = (struct cry_uring_pdu *)ioucmd->pdu;
+	struct cry_job *job = pdu->job;
+
+	if (!cry_sched_cancel(job)) {
+		return;
+	}
+	cry_uring_free_job(job);
+	cry_uring_done(ioucmd, -ECANCELED, 0, issue_flags);
+}
+#endif
+#endif
+
+/* Show the amount of queued jobs of each weight class, from weight 1 to the maximum weight. */
+static ssize_t sched_queue_depth_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	unsigned int depth[CRY_WEIGHT_MAX + 1] = { 0 };
+	struct cry_queue *queue;
+	int len = 0;
+	int cpu;
 	int i;
-	int j;
-	size_t idx;
 
-	for (idx = 0, i = 0, j = 0; idx < len; ++idx) {
-		unsigned char t = state[i];
+	/* Statistics are summed from the queues of all CPUs. */
+	for_each_possible_cpu(cpu) {
+		queue = per_cpu(cry_queues, cpu);
+		spin_lock(&queue->lock);
+		for (i = CRY_WEIGHT_MIN; i <= CRY_WEIGHT_MAX; i++) {
+			depth[i] += queue->stats[i].depth;
+		}
+		spin_unlock(&queue->lock);
+	}
 
-		i = (i + 1) % 256;
-		j = (j + state[i]) % 256;
-		state[i] = state[j];
-		state[j] = t;
-		out[idx] = state[(state[i] + t) % 256];
+	for (i = CRY_WEIGHT_MIN; i <= CRY_WEIGHT_MAX; i++) {
+		len += sysfs_emit_at(buf, len, "%u%c", depth[i],
+				     i == CRY_WEIGHT_MAX ? '\n' : ' ');
 	}
+	return len;
 }
 
-void rc4(unsigned char *key, unsigned char *msg)
+/* Show the average time jobs of each weight class have waited before starting, in nanoseconds. */
+static ssize_t sched_wait_ns_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
 {
-	unsigned char state[256];
-	unsigned char buf[MESSAGE_MAX_SIZE];
-	size_t i;
+	u64 jobs[CRY_WEIGHT_MAX + 1] = { 0 };
+	u64 waitNs[CRY_WEIGHT_MAX + 1] = { 0 };
+	struct cry_queue *queue;
+	int len = 0;
+	int cpu;
+	int i;
+
+	for_each_possible_cpu(cpu) {
+		queue = per_cpu(cry_queues, cpu);
+		spin_lock(&queue->lock);
+		for (i = CRY_WEIGHT_MIN; i <= CRY_WEIGHT_MAX; i++) {
+			jobs[i] += queue->stats[i].jobs;
+			waitNs[i] += queue->stats[i].waitNs;
+		}
+		spin_unlock(&queue->lock);
+	}
 
-	rc4_key_setup(state, key, strlen(key));
-	rc4_generate_stream(state, buf, MESSAGE_MAX_SIZE);
-	for (i = 0; i < strlen(msg); i++) {
-		msg[i] ^= buf[i];
+	for (i = CRY_WEIGHT_MIN; i <= CRY_WEIGHT_MAX; i++) {
+		len += sysfs_emit_at(buf, len, "%llu%c",
+				     jobs[i] ? div64_u64(waitNs[i], jobs[i]) : 0,
+				     i == CRY_WEIGHT_MAX ? '\n' : ' ');
 	}
+	return len;
 }
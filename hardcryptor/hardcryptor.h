@@ -0,0 +1,153 @@
+/*
+    Interface of the hardcryptor character device (/dev/hcry).
+    Shared by the kernel module and the user space programs using the device.
+*/
+#ifndef HARDCRYPTOR_H
+#define HARDCRYPTOR_H
+
+/* Ioctl headers, needed for defining the ioctl call numbers. */
+#include <linux/ioctl.h>
+/* Type definitions, needed for the fixed size types shared with user space. */
+#include <linux/types.h>
+
+/* Magic number for the ioctl calls */
+#define CRY_IOC_MAGIC 'c'
+/* IOCTL-call values used for setting and getting the encryption key. */
+#define CRY_IOC_SET_KEY _IOW(CRY_IOC_MAGIC, 1, char*)
+#define CRY_IOC_GET_KEY _IOR(CRY_IOC_MAGIC, 2, char*)
+
+/* Maximum amount of stages in a transform chain. */
+#define CRY_CHAIN_MAX_STAGES 8
+/* Stage which XORs the data with the RC4-stream of the encryption key, allowed once per chain. */
+#define CRY_STAGE_RC4 0
+/* Stage which rotates alphabetic characters by arg, needs the rot module to be loaded. */
+#define CRY_STAGE_ROT 1
+
+/* Single stage of a transform chain. */
+struct cry_stage {
+	__u32 type;
+	__s32 arg;
+};
+
+/* Stages which are applied to every written message in the given order. */
+/* Empty chain is the default and means a single RC4 stage. */
+struct cry_chain {
+	__u32 count;
+	struct cry_stage stages[CRY_CHAIN_MAX_STAGES];
+};
+
+/* IOCTL-call values used for setting and getting the transform chain. */
+#define CRY_IOC_SET_CHAIN _IOW(CRY_IOC_MAGIC, 3, struct cry_chain)
+#define CRY_IOC_GET_CHAIN _IOR(CRY_IOC_MAGIC, 4, struct cry_chain)
+
+/* Scheduling weights of a session, a bigger weight gets a bigger share of the encryption work queued on a CPU. */
+/* Writes of default weight sessions on an idle CPU are not queued, see the README. */
+/* Weights above the default need CAP_SYS_NICE. */
+#define CRY_WEIGHT_MIN 1
+#define CRY_WEIGHT_DEFAULT 4
+#define CRY_WEIGHT_MAX 8
+
+/* IOCTL-call values used for setting and getting the scheduling weight of the session. */
+#define CRY_IOC_SET_WEIGHT _IOW(CRY_IOC_MAGIC, 5, __u32)
+#define CRY_IOC_GET_WEIGHT _IOR(CRY_IOC_MAGIC, 6, __u32)
+
+/* Checksum flags of a session, CRC32C can be computed from the data written and/or the data to be read. */
+#define CRY_CSUM_INPUT 1
+#define CRY_CSUM_OUTPUT 2
+
+/* CRC32C checksums of the last message, computed in the same pass as the transform. */
+/* For encryption the input is the plaintext and the output is the ciphertext. */
+struct cry_csum {
+	__u32 flags;
+	__u32 input;
+	__u32 output;
+};
+
+/* IOCTL-call values used for choosing the checksums and getting them for the last message. */
+#define CRY_IOC_SET_CSUM _IOW(CRY_IOC_MAGIC, 7, __u32)
+#define CRY_IOC_GET_CSUM _IOR(CRY_IOC_MAGIC, 8, struct cry_csum)
+
+/* Compression modes of a session. */
+#define CRY_COMPRESS_NONE 0
+/* Written data is compressed with LZ4 into a frame before it is transformed. */
+#define CRY_COMPRESS_LZ4 1
+/* Written frame is transformed and then decompressed, reverses CRY_COMPRESS_LZ4. */
+#define CRY_DECOMPRESS_LZ4 2
+
+/* Header of a compressed frame, followed by the compressed data. */
+/* Data which doesn't compress is stored as is, which is seen from the sizes being equal. */
+struct cry_frame {
+	__le32 originalSize;
+	__le32 compressedSize;
+};
+
+/* IOCTL-call values used for setting and getting the compression mode of the session. */
+#define CRY_IOC_SET_COMPRESS _IOW(CRY_IOC_MAGIC, 9, __u32)
+#define CRY_IOC_GET_COMPRESS _IOR(CRY_IOC_MAGIC, 10, __u32)
+
+/* IOCTL-call values used for turning the lazy mode of the session on and off. */
+/* In the lazy mode written messages are stored as is and transformed while they are read. */
+#define CRY_IOC_SET_LAZY _IOW(CRY_IOC_MAGIC, 11, __u32)
+#define CRY_IOC_GET_LAZY _IOR(CRY_IOC_MAGIC, 12, __u32)
+
+/* IOCTL-call values used for turning the stream mode of the session on and off. */
+/* In the stream mode the RC4-stream continues from message to message instead of starting from */
+/* the beginning for every message. Setting the key or the mode starts the stream from the beginning. */
+#define CRY_IOC_SET_STREAM _IOW(CRY_IOC_MAGIC, 15, __u32)
+#define CRY_IOC_GET_STREAM _IOR(CRY_IOC_MAGIC, 16, __u32)
+
+/* io_uring command (IORING_OP_URING_CMD) which encrypts/decrypts a user buffer in place. */
+/* Result of the completion is the amount of bytes transformed, with 32 byte completions the */
+/* input and output checksums of the buffer are in the high and low half of the extra result. */
+#define CRY_URING_CMD_CRYPT 1
+
+/* Command data in the submission of CRY_URING_CMD_CRYPT, buffer can be at most 1024 bytes. */
+struct cry_uring_cmd {
+	__u64 addr;
+	__u32 len;
+	__u32 reserved;
+};
+
+/* IOCTL-call for allocating the staging buffer of the session, argument is its size in bytes. */
+/* Staging buffer is mapped to user space with mmap at offset 0, zero size frees the buffer. */
+#define CRY_IOC_SET_STAGING _IOW(CRY_IOC_MAGIC, 13, __u64)
+/* Maximum size of the staging buffer. */
+#define CRY_STAGING_MAX_SIZE (64 << 20)
+
+/* Range of the staging buffer, which is encrypted/decrypted in place as a single message. */
+struct cry_range {
+	__u64 offset;
+	__u64 len;
+};
+
+/* IOCTL-call for encrypting/decrypting a range of the staging buffer. */
+#define CRY_IOC_CRYPT_STAGING _IOW(CRY_IOC_MAGIC, 14, struct cry_range)
+
+/* Offset of the read-only status page, mapped with mmap(NULL, page size, PROT_READ, MAP_SHARED, fd, CRY_STATUS_OFFSET). */
+#define CRY_STATUS_OFFSET 0x40000000
+#define CRY_STATUS_VERSION 1
+
+/* Where the messages are processed. */
+#define CRY_PATH_LOCAL_CPU 0
+#define CRY_PATH_PINNED_CPU 1
+
+/* Counters of the whole device in the status page, updated every statusInterval milliseconds while mapped. */
+/* Like in the perf mmap page, lock is odd while the page is being updated, and a reader retries */
+/* until it reads the same even lock before and after the counters. */
+struct cry_status {
+	__u32 version;
+	__u32 lock;
+	/* Bytes transformed and messages completed since the module was loaded. */
+	__u64 bytes;
+	__u64 ops;
+	/* Messages queued or being processed, and the open sessions. */
+	__u64 queued;
+	__u64 sessions;
+	/* CRY_PATH_LOCAL_CPU or CRY_PATH_PINNED_CPU and the CPU messages are pinned to. */
+	__u32 path;
+	__s32 pathCpu;
+	/* Monotonic time of the last update in nanoseconds. */
+	__u64 updatedNs;
+};
+
+#endif
@@ -0,0 +1,341 @@
+/*
+    User space implementation of the hardcryptor character device using CUSE.
+    Serves the same write/read protocol and key ioctls as the kernel module, so
+    the same clients can be used where the module can't be loaded, and the two
+    can be benchmarked against each other.
+*/
+#define FUSE_USE_VERSION 31
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <cuse_lowlevel.h>
+#include <fuse_opt.h>
+#include "hardcryptor.h"
+#include "rc4.h"
+
+/* Same limits as in the kernel module. */
+#define MESSAGE_MAX_SIZE 1024
+#define KEY_MIN_SIZE 16
+#define KEY_MAX_SIZE 1024
+/* Default name of the device, differs from the kernel module so both can be loaded at once. */
+#define DEVICE_NAME "hcry-cuse"
+
+/* State of a single opened device file. */
+struct hcryd_session {
+	pthread_mutex_t lock;
+	char encryptionKey[KEY_MAX_SIZE];
+	struct rc4_state keyState;
+	/* RC4-stream continues over the messages in the stream mode. */
+	int stream;
+	struct rc4_state streamState;
+	char msg[MESSAGE_MAX_SIZE];
+	size_t msgSize;
+};
+
+/* Command line options of the server. */
+struct hcryd_param {
+	char *devName;
+};
+
+#define HCRYD_OPT(t, p) { t, offsetof(struct hcryd_param, p), 1 }
+
+static const struct fuse_opt hcrydOpts[] = {
+	HCRYD_OPT("-n %s", devName),
+	HCRYD_OPT("--name=%s", devName),
+	FUSE_OPT_KEY("-h", 0),
+	FUSE_OPT_KEY("--help", 0),
+	FUSE_OPT_END
+};
+
+/* Avoid leaving keys and messages behind, the compiler may not drop this memset. */
+static void clear_buffer(void *buf, size_t len)
+{
+	volatile unsigned char *p = buf;
+
+	while (len--)
+		*p++ = 0;
+}
+
+static void hcryd_open(fuse_req_t req, struct fuse_file_info *fi)
+{
+	struct hcryd_session *session;
+
+	session = calloc(1, sizeof(*session));
+	if (session == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	pthread_mutex_init(&session->lock, NULL);
+	fi->fh = (uintptr_t)session;
+	fi->direct_io = 1;
+	fi->nonseekable = 1;
+	fuse_reply_open(req, fi);
+}
+
+static void hcryd_release(fuse_req_t req, struct fuse_file_info *fi)
+{
+	struct hcryd_session *session = (struct hcryd_session *)(uintptr_t)fi->fh;
+
+	pthread_mutex_destroy(&session->lock);
+	clear_buffer(session, sizeof(*session));
+	free(session);
+	fuse_reply_err(req, 0);
+}
+
+static void hcryd_read(fuse_req_t req, size_t len, off_t off,
+		       struct fuse_file_info *fi)
+{
+	struct hcryd_session *session = (struct hcryd_session *)(uintptr_t)fi->fh;
+	char buf[MESSAGE_MAX_SIZE];
+	size_t charcount;
+	(void)off;
+
+	pthread_mutex_lock(&session->lock);
+	/* If length is specified and it is shorter than message size, use it. */
+	charcount = session->msgSize;
+	if (len > 0 && len < session->msgSize) {
+		charcount = len;
+	}
+	memcpy(buf, session->msg, charcount);
+	clear_buffer(session->msg, sizeof(session->msg));
+	session->msgSize = 0;
+	pthread_mutex_unlock(&session->lock);
+
+	fuse_reply_buf(req, buf, charcount);
+	clear_buffer(buf, charcount);
+}
+
+static void hcryd_write(fuse_req_t req, const char *buffer, size_t len,
+			off_t off, struct fuse_file_info *fi)
+{
+	struct hcryd_session *session = (struct hcryd_session *)(uintptr_t)fi->fh;
+	struct rc4_state state;
+	size_t charcount = MESSAGE_MAX_SIZE;
+	(void)off;
+
+	pthread_mutex_lock(&session->lock);
+	/* If there is no encryption key, return an invalid argument error. */
+	if (session->encryptionKey[0] == '\0') {
+		pthread_mutex_unlock(&session->lock);
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+
+	/* Messages longer than the maximum size are cut, like the kernel module does. */
+	if (len < MESSAGE_MAX_SIZE) {
+		charcount = len;
+	}
+	memcpy(session->msg, buffer, charcount);
+	session->msgSize = charcount;
+
+	/* Every message starts from the beginning of the RC4-stream, unless the session is in the stream mode. */
+	state = session->stream ? session->streamState : session->keyState;
+	rc4_crypt(&state, (unsigned char *)session->msg, charcount);
+	if (session->stream) {
+		session->streamState = state;
+	}
+	clear_buffer(&state, sizeof(state));
+	pthread_mutex_unlock(&session->lock);
+
+	fuse_reply_write(req, charcount);
+}
+
+/* Validate the key and set it to the session, returns 0 or an errno value. */
+static int hcryd_set_key(struct hcryd_session *session, const char *key,
+			 size_t keyLen)
+{
+	size_t i;
+
+	if (keyLen < KEY_MIN_SIZE || keyLen >= KEY_MAX_SIZE) {
+		return EINVAL;
+	}
+	/* For example, any control characters are not allowed. */
+	for (i = 0; i < keyLen; i++) {
+		unsigned char c = key[i];
+
+		if (!isalnum(c) && !isspace(c) && !ispunct(c)) {
+			return EPERM;
+		}
+	}
+
+	pthread_mutex_lock(&session->lock);
+	clear_buffer(session->msg, sizeof(session->msg));
+	session->msgSize = 0;
+	clear_buffer(session->encryptionKey, sizeof(session->encryptionKey));
+	memcpy(session->encryptionKey, key, keyLen);
+	rc4_key_setup(&session->keyState,
+		      (const unsigned char *)session->encryptionKey, keyLen);
+	session->streamState = session->keyState;
+	pthread_mutex_unlock(&session->lock);
+	return 0;
+}
+
+/* Length of the key in a partially fetched buffer, or in_bufsz if the terminating null wasn't found yet. */
+static size_t key_length(const void *in_buf, size_t in_bufsz)
+{
+	const char *end;
+
+	if (in_bufsz == 0)
+		return 0;
+	end = memchr(in_buf, '\0', in_bufsz);
+
+	return end ? (size_t)(end - (const char *)in_buf) : in_bufsz;
+}
+
+static void hcryd_ioctl(fuse_req_t req, int cmd, void *arg,
+			struct fuse_file_info *fi, unsigned flags,
+			const void *in_buf, size_t in_bufsz, size_t out_bufsz)
+{
+	struct hcryd_session *session = (struct hcryd_session *)(uintptr_t)fi->fh;
+	struct iovec iov;
+	char key[KEY_MAX_SIZE];
+	uint32_t mode;
+	size_t want;
+	int err;
+
+	if (flags & FUSE_IOCTL_COMPAT) {
+		fuse_reply_err(req, ENOSYS);
+		return;
+	}
+
+	switch ((unsigned int)cmd) {
+	case CRY_IOC_SET_KEY:
+		if (arg == NULL) {
+			fuse_reply_err(req, EINVAL);
+			return;
+		}
+		/* Key is a null terminated string of unknown length behind the pointer. */
+		/* Fetch it a page at a time, so a short key at the end of a mapping doesn't fault. */
+		if (in_bufsz == key_length(in_buf, in_bufsz) && in_bufsz < KEY_MAX_SIZE) {
+			want = in_bufsz + sysconf(_SC_PAGESIZE) -
+			       ((uintptr_t)arg + in_bufsz) % sysconf(_SC_PAGESIZE);
+			if (want > KEY_MAX_SIZE) {
+				want = KEY_MAX_SIZE;
+			}
+			iov.iov_base = arg;
+			iov.iov_len = want;
+			fuse_reply_ioctl_retry(req, &iov, 1, NULL, 0);
+			return;
+		}
+		err = hcryd_set_key(session, in_buf, key_length(in_buf, in_bufsz));
+		if (err != 0) {
+			fuse_reply_err(req, err);
+			return;
+		}
+		fuse_reply_ioctl(req, 0, NULL, 0);
+		return;
+	case CRY_IOC_GET_KEY:
+		/* Kernel module copies the whole key buffer to the user. */
+		if (out_bufsz < KEY_MAX_SIZE) {
+			iov.iov_base = arg;
+			iov.iov_len = KEY_MAX_SIZE;
+			fuse_reply_ioctl_retry(req, NULL, 0, &iov, 1);
+			return;
+		}
+		pthread_mutex_lock(&session->lock);
+		if (session->encryptionKey[0] == '\0') {
+			pthread_mutex_unlock(&session->lock);
+			fuse_reply_err(req, EINVAL);
+			return;
+		}
+		memcpy(key, session->encryptionKey, KEY_MAX_SIZE);
+		pthread_mutex_unlock(&session->lock);
+		fuse_reply_ioctl(req, 0, key, KEY_MAX_SIZE);
+		clear_buffer(key, sizeof(key));
+		return;
+	case CRY_IOC_SET_STREAM:
+		if (in_bufsz < sizeof(mode)) {
+			iov.iov_base = arg;
+			iov.iov_len = sizeof(mode);
+			fuse_reply_ioctl_retry(req, &iov, 1, NULL, 0);
+			return;
+		}
+		memcpy(&mode, in_buf, sizeof(mode));
+		if (mode > 1) {
+			fuse_reply_err(req, EINVAL);
+			return;
+		}
+		pthread_mutex_lock(&session->lock);
+		session->stream = mode;
+		session->streamState = session->keyState;
+		pthread_mutex_unlock(&session->lock);
+		fuse_reply_ioctl(req, 0, NULL, 0);
+		return;
+	case CRY_IOC_GET_STREAM:
+		if (out_bufsz < sizeof(mode)) {
+			iov.iov_base = arg;
+			iov.iov_len = sizeof(mode);
+			fuse_reply_ioctl_retry(req, NULL, 0, &iov, 1);
+			return;
+		}
+		mode = session->stream;
+		fuse_reply_ioctl(req, 0, &mode, sizeof(mode));
+		return;
+	default:
+		/* Transform chains, scheduling, checksums, compression and the lazy mode are only in the kernel module. */
+		fuse_reply_err(req, ENOTTY);
+		return;
+	}
+}
+
+static const struct cuse_lowlevel_ops hcrydOps = {
+	.open = hcryd_open,
+	.read = hcryd_read,
+	.write = hcryd_write,
+	.release = hcryd_release,
+	.ioctl = hcryd_ioctl,
+};
+
+static int hcryd_process_arg(void *data, const char *arg, int key,
+			     struct fuse_args *outargs)
+{
+	(void)data;
+	(void)arg;
+	(void)outargs;
+
+	if (key == 0) {
+		fprintf(stderr,
+			"Usage: hcryd [options]\n"
+			"    --name=NAME|-n NAME   device name (default: " DEVICE_NAME ")\n"
+			"    -f                    stay in the foreground\n"
+			"    -s                    single threaded operation\n");
+		return fuse_opt_add_arg(outargs, "-ho");
+	}
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct hcryd_param param = { 0 };
+	char devName[128];
+	const char *devInfo[] = { devName };
+	struct cuse_info ci;
+	int ret;
+
+	if (fuse_opt_parse(&args, &param, hcrydOpts, hcryd_process_arg)) {
+		return 1;
+	}
+
+	snprintf(devName, sizeof(devName), "DEVNAME=%s",
+		 param.devName ? param.devName : DEVICE_NAME);
+
+	memset(&ci, 0, sizeof(ci));
+	ci.dev_info_argc = 1;
+	ci.dev_info_argv = devInfo;
+	/* Key ioctls pass a pointer to a string, which needs unrestricted ioctls. */
+	ci.flags = CUSE_UNRESTRICTED_IOCTL;
+
+	ret = cuse_lowlevel_main(args.argc, args.argv, &ci, &hcrydOps, NULL);
+	fuse_opt_free_args(&args);
+	free(param.devName);
+	return ret;
+}
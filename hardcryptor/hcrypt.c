@@ -0,0 +1,51 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include "libhcry.h"
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-f device] key\n"
+		"Encrypts/decrypts standard input to standard output as a single RC4-stream.\n",
+		name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct hcry_pool *pool;
+	const char *device = HCRY_DEVICE;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "f:")) != -1) {
+		switch (opt) {
+		case 'f':
+			device = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return EINVAL;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return EINVAL;
+	}
+
+	/* Stream is transformed in order by a single handle. */
+	pool = hcry_pool_open(device, 1, argv[optind]);
+	if (pool == NULL) {
+		perror("Could not open the device!");
+		return errno;
+	}
+
+	ret = hcry_stream(pool, STDIN_FILENO, STDOUT_FILENO);
+	if (ret < 0) {
+		ret = errno;
+		perror("Could not encrypt/decrypt the stream!");
+	}
+	hcry_pool_close(pool);
+	return ret;
+}
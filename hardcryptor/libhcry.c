@@ -0,0 +1,450 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include "hardcryptor.h"
+#include "libhcry.h"
+
+/* States of a slot in the stream ring. */
+#define SLOT_FREE 0
+#define SLOT_READY 1
+#define SLOT_BUSY 2
+#define SLOT_DONE 3
+/* Amount of slots in the stream ring, enough to keep reading, transforming and writing busy. */
+#define STREAM_SLOTS 8
+
+struct hcry_pool {
+	int size;
+	int fds[HCRY_POOL_MAX];
+	/* Stack of free handles, protected by lock. */
+	int freeFds[HCRY_POOL_MAX];
+	int freeCount;
+	pthread_mutex_t lock;
+	pthread_cond_t freed;
+};
+
+/* One message in flight in the stream ring. */
+struct hcry_slot {
+	char in[HCRY_MSG_MAX];
+	char out[HCRY_MSG_MAX];
+	size_t len;
+	int state;
+};
+
+/* Shared state of hcry_stream, everything below lock is protected by it. */
+struct hcry_stream {
+	/* Handle in the stream mode which transforms all of the messages in order. */
+	int fd;
+	int infd;
+	struct hcry_slot *slots;
+	int slotCount;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	/* Sequence numbers of the next message to read, to transform and to write. */
+	unsigned long nextRead;
+	unsigned long nextWork;
+	unsigned long nextWrite;
+	int eof;
+	int error;
+};
+
+/* Shared state of hcry_crypt_parallel. */
+struct hcry_parallel {
+	struct hcry_pool *pool;
+	struct hcry_msg *msgs;
+	size_t count;
+	size_t next;
+	int error;
+	pthread_mutex_t lock;
+};
+
+/* Read until the buffer is full or the end of file is reached. */
+static ssize_t read_full(int fd, char *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = read(fd, buf + done, len - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+/* Write the whole buffer, retrying short writes. */
+static int write_full(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -1;
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+struct hcry_pool *hcry_pool_open(const char *path, int size, const char *key)
+{
+	struct hcry_pool *pool;
+	int i, err;
+
+	if (size < 1 || size > HCRY_POOL_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+	pool = calloc(1, sizeof(*pool));
+	if (pool == NULL)
+		return NULL;
+	if (path == NULL)
+		path = HCRY_DEVICE;
+
+	for (i = 0; i < size; ++i) {
+		pool->fds[i] = open(path, O_RDWR);
+		if (pool->fds[i] < 0 || ioctl(pool->fds[i], CRY_IOC_SET_KEY, key) < 0) {
+			err = errno;
+			if (pool->fds[i] >= 0)
+				close(pool->fds[i]);
+			while (i-- > 0)
+				close(pool->fds[i]);
+			free(pool);
+			errno = err;
+			return NULL;
+		}
+		pool->freeFds[i] = pool->fds[i];
+	}
+	pool->size = size;
+	pool->freeCount = size;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->freed, NULL);
+	return pool;
+}
+
+void hcry_pool_close(struct hcry_pool *pool)
+{
+	int i;
+
+	if (pool == NULL)
+		return;
+	for (i = 0; i < pool->size; ++i)
+		close(pool->fds[i]);
+	pthread_cond_destroy(&pool->freed);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+int hcry_acquire(struct hcry_pool *pool)
+{
+	int fd;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->freeCount == 0)
+		pthread_cond_wait(&pool->freed, &pool->lock);
+	fd = pool->freeFds[--pool->freeCount];
+	pthread_mutex_unlock(&pool->lock);
+	return fd;
+}
+
+void hcry_release(struct hcry_pool *pool, int fd)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->freeFds[pool->freeCount++] = fd;
+	pthread_cond_signal(&pool->freed);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+ssize_t hcry_crypt_fd(int fd, const void *in, void *out, size_t len)
+{
+	ssize_t ret;
+
+	/* Zero length write would be taken as a maximum sized message by the device. */
+	if (len == 0)
+		return 0;
+	if (len > HCRY_MSG_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	ret = write(fd, in, len);
+	if (ret < 0)
+		return -1;
+	return read(fd, out, len);
+}
+
+/* Turn the stream mode of a handle on or off, both start the stream from the beginning. */
+static int set_stream(int fd, uint32_t mode)
+{
+	return ioctl(fd, CRY_IOC_SET_STREAM, &mode);
+}
+
+ssize_t hcry_crypt(struct hcry_pool *pool, const void *in, void *out,
+		   size_t len)
+{
+	size_t done = 0;
+	size_t chunk;
+	ssize_t ret = 0;
+	int err;
+	int fd;
+
+	fd = hcry_acquire(pool);
+	/* Longer buffers are transformed as one stream, so no two messages share the keystream. */
+	if (len > HCRY_MSG_MAX && set_stream(fd, 1) < 0) {
+		err = errno;
+		hcry_release(pool, fd);
+		errno = err;
+		return -1;
+	}
+	while (done < len) {
+		chunk = len - done < HCRY_MSG_MAX ? len - done : HCRY_MSG_MAX;
+		ret = hcry_crypt_fd(fd, (const char *)in + done,
+				    (char *)out + done, chunk);
+		if (ret < 0)
+			break;
+		done += ret;
+	}
+	if (len > HCRY_MSG_MAX) {
+		err = errno;
+		set_stream(fd, 0);
+		errno = err;
+	}
+	hcry_release(pool, fd);
+	return ret < 0 ? ret : (ssize_t)done;
+}
+
+/* Transforming thread of hcry_crypt_parallel, takes messages until none is left. */
+static void *parallel_worker(void *arg)
+{
+	struct hcry_parallel *batch = arg;
+	struct hcry_msg *msg;
+
+	for (;;) {
+		pthread_mutex_lock(&batch->lock);
+		if (batch->next == batch->count || batch->error) {
+			pthread_mutex_unlock(&batch->lock);
+			break;
+		}
+		msg = &batch->msgs[batch->next++];
+		pthread_mutex_unlock(&batch->lock);
+
+		if (hcry_crypt(batch->pool, msg->in, msg->out, msg->len) < 0) {
+			pthread_mutex_lock(&batch->lock);
+			batch->error = errno;
+			pthread_mutex_unlock(&batch->lock);
+		}
+	}
+	return NULL;
+}
+
+int hcry_crypt_parallel(struct hcry_pool *pool, struct hcry_msg *msgs,
+			size_t count)
+{
+	struct hcry_parallel batch = {
+		.pool = pool,
+		.msgs = msgs,
+		.count = count,
+	};
+	pthread_t threads[HCRY_POOL_MAX];
+	int threadCount = 0;
+	int i;
+
+	pthread_mutex_init(&batch.lock, NULL);
+	/* One thread per handle keeps every handle busy, the calling thread takes part too. */
+	for (i = 1; i < pool->size && (size_t)i < count; ++i) {
+		if (pthread_create(&threads[threadCount], NULL, parallel_worker,
+				   &batch) != 0)
+			break;
+		threadCount++;
+	}
+	parallel_worker(&batch);
+	for (i = 0; i < threadCount; ++i)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&batch.lock);
+
+	if (batch.error) {
+		errno = batch.error;
+		return -1;
+	}
+	return 0;
+}
+
+/* Reading thread of a stream, cuts the input to full messages. */
+static void *stream_reader(void *arg)
+{
+	struct hcry_stream *stream = arg;
+	struct hcry_slot *slot;
+	ssize_t len;
+
+	for (;;) {
+		pthread_mutex_lock(&stream->lock);
+		slot = &stream->slots[stream->nextRead % stream->slotCount];
+		while (slot->state != SLOT_FREE && !stream->error)
+			pthread_cond_wait(&stream->changed, &stream->lock);
+		if (stream->error) {
+			pthread_mutex_unlock(&stream->lock);
+			break;
+		}
+		pthread_mutex_unlock(&stream->lock);
+
+		/* Short reads from pipes are coalesced so every message but the last is full. */
+		len = read_full(stream->infd, slot->in, HCRY_MSG_MAX);
+
+		pthread_mutex_lock(&stream->lock);
+		if (len < 0) {
+			stream->error = errno;
+		} else if (len == 0) {
+			stream->eof = 1;
+		} else {
+			slot->len = len;
+			slot->state = SLOT_READY;
+			stream->nextRead++;
+			if (len < HCRY_MSG_MAX)
+				stream->eof = 1;
+		}
+		pthread_cond_broadcast(&stream->changed);
+		if (stream->eof || stream->error) {
+			pthread_mutex_unlock(&stream->lock);
+			break;
+		}
+		pthread_mutex_unlock(&stream->lock);
+	}
+	return NULL;
+}
+
+/* Transforming thread of a stream, the messages go through its handle in the order they were read. */
+static void *stream_worker(void *arg)
+{
+	struct hcry_stream *stream = arg;
+	struct hcry_slot *slot;
+	ssize_t ret;
+
+	for (;;) {
+		pthread_mutex_lock(&stream->lock);
+		while (stream->nextWork == stream->nextRead && !stream->eof
+		       && !stream->error)
+			pthread_cond_wait(&stream->changed, &stream->lock);
+		if (stream->error || stream->nextWork == stream->nextRead) {
+			pthread_mutex_unlock(&stream->lock);
+			break;
+		}
+		slot = &stream->slots[stream->nextWork++ % stream->slotCount];
+		slot->state = SLOT_BUSY;
+		pthread_mutex_unlock(&stream->lock);
+
+		ret = hcry_crypt_fd(stream->fd, slot->in, slot->out, slot->len);
+		if (ret != (ssize_t)slot->len) {
+			pthread_mutex_lock(&stream->lock);
+			/* Short transform doesn't set errno. */
+			stream->error = ret < 0 ? errno : EIO;
+			pthread_cond_broadcast(&stream->changed);
+			pthread_mutex_unlock(&stream->lock);
+			break;
+		}
+
+		pthread_mutex_lock(&stream->lock);
+		slot->state = SLOT_DONE;
+		pthread_cond_broadcast(&stream->changed);
+		pthread_mutex_unlock(&stream->lock);
+	}
+	return NULL;
+}
+
+int hcry_stream(struct hcry_pool *pool, int infd, int outfd)
+{
+	struct hcry_stream stream = {
+		.infd = infd,
+	};
+	pthread_t reader;
+	pthread_t worker;
+	struct hcry_slot *slot;
+	int workerStarted = 0;
+
+	stream.slotCount = STREAM_SLOTS;
+	stream.slots = calloc(stream.slotCount, sizeof(*stream.slots));
+	if (stream.slots == NULL)
+		return -1;
+	pthread_mutex_init(&stream.lock, NULL);
+	pthread_cond_init(&stream.changed, NULL);
+
+	/* Whole input is one stream on one handle, so every byte gets its own part of the keystream. */
+	stream.fd = hcry_acquire(pool);
+	if (set_stream(stream.fd, 1) < 0) {
+		stream.error = errno;
+		hcry_release(pool, stream.fd);
+		goto out;
+	}
+
+	if (pthread_create(&reader, NULL, stream_reader, &stream) != 0) {
+		stream.error = EAGAIN;
+		goto release;
+	}
+	if (pthread_create(&worker, NULL, stream_worker, &stream) != 0) {
+		pthread_mutex_lock(&stream.lock);
+		stream.error = EAGAIN;
+		pthread_cond_broadcast(&stream.changed);
+		pthread_mutex_unlock(&stream.lock);
+	} else {
+		workerStarted = 1;
+	}
+
+	/* Calling thread writes the messages out in the order they were read. */
+	for (;;) {
+		pthread_mutex_lock(&stream.lock);
+		slot = &stream.slots[stream.nextWrite % stream.slotCount];
+		while (slot->state != SLOT_DONE && !stream.error
+		       && !(stream.eof && stream.nextWrite == stream.nextRead))
+			pthread_cond_wait(&stream.changed, &stream.lock);
+		if (slot->state != SLOT_DONE) {
+			pthread_mutex_unlock(&stream.lock);
+			break;
+		}
+		pthread_mutex_unlock(&stream.lock);
+
+		if (write_full(outfd, slot->out, slot->len) < 0) {
+			pthread_mutex_lock(&stream.lock);
+			stream.error = errno;
+			pthread_cond_broadcast(&stream.changed);
+			pthread_mutex_unlock(&stream.lock);
+			break;
+		}
+
+		pthread_mutex_lock(&stream.lock);
+		memset(slot, 0, sizeof(*slot));
+		stream.nextWrite++;
+		pthread_cond_broadcast(&stream.changed);
+		pthread_mutex_unlock(&stream.lock);
+	}
+
+	if (workerStarted)
+		pthread_join(worker, NULL);
+	pthread_join(reader, NULL);
+release:
+	/* Turning the stream mode off also clears the stream state of the handle. */
+	set_stream(stream.fd, 0);
+	hcry_release(pool, stream.fd);
+out:
+	pthread_cond_destroy(&stream.changed);
+	pthread_mutex_destroy(&stream.lock);
+	/* Avoid leaving plain text behind in freed memory. */
+	memset(stream.slots, 0, stream.slotCount * sizeof(*stream.slots));
+	free(stream.slots);
+
+	if (stream.error) {
+		errno = stream.error;
+		return -1;
+	}
+	return 0;
+}
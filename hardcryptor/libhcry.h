@@ -0,0 +1,54 @@
+#ifndef LIBHCRY_H
+#define LIBHCRY_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Default path of the hardcryptor character device. */
+#define HCRY_DEVICE "/dev/hcry"
+/* Maximum size of one message, the device transforms at most this many bytes per write. */
+#define HCRY_MSG_MAX 1024
+/* Maximum number of device handles in one pool. */
+#define HCRY_POOL_MAX 64
+
+/* Pool of open device handles which all share the same encryption key. */
+struct hcry_pool;
+
+/* One message of hcry_crypt_parallel, out must have room for len bytes. */
+struct hcry_msg {
+	const void *in;
+	void *out;
+	size_t len;
+};
+
+/* Open size device handles and set the encryption key to all of them. */
+/* Returns NULL and sets errno if the pool could not be created. */
+struct hcry_pool *hcry_pool_open(const char *path, int size, const char *key);
+/* Close all handles of the pool, the pool must not be in use. */
+void hcry_pool_close(struct hcry_pool *pool);
+
+/* Take a free handle from the pool, blocks until one is available. */
+int hcry_acquire(struct hcry_pool *pool);
+/* Give a handle taken with hcry_acquire back to the pool. */
+void hcry_release(struct hcry_pool *pool, int fd);
+
+/* Encrypt/decrypt one message of at most HCRY_MSG_MAX bytes with the given handle. */
+/* Returns the amount of bytes transformed or -1 and sets errno. */
+ssize_t hcry_crypt_fd(int fd, const void *in, void *out, size_t len);
+/* Encrypt/decrypt a buffer as a single RC4-stream. */
+/* Longer buffers are split to messages of HCRY_MSG_MAX bytes, which a handle in the stream mode */
+/* (CRY_IOC_SET_STREAM) transforms with consecutive parts of the stream. */
+ssize_t hcry_crypt(struct hcry_pool *pool, const void *in, void *out,
+		   size_t len);
+/* Encrypt/decrypt count independent buffers with hcry_crypt, spread over threads, one per handle of the pool. */
+/* Nothing is coalesced, every buffer takes its own write and read calls. Every buffer starts from */
+/* the beginning of the RC4-stream, so the same key must not be used for more than one of them. */
+/* Returns 0 or -1 and sets errno if any of the messages failed. */
+int hcry_crypt_parallel(struct hcry_pool *pool, struct hcry_msg *msgs,
+			size_t count);
+
+/* Encrypt/decrypt everything from infd to outfd until end of file as a single RC4-stream. */
+/* One handle in the stream mode transforms all of the data, reading and writing run in their own threads. */
+int hcry_stream(struct hcry_pool *pool, int infd, int outfd);
+
+#endif
@@ -0,0 +1,62 @@
+/*
+    RC4-cipher shared by the kernel module and the user space programs.
+    Following public domain RC4-implementation is from
+    https://github.com/B-Con/crypto-algorithms
+*/
+#ifndef HARDCRYPTOR_RC4_H
+#define HARDCRYPTOR_RC4_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stddef.h>
+#endif
+
+/* RC4 cipher state, which allows the RC4-stream to be applied to a message in pieces. */
+struct rc4_state {
+	unsigned char s[256];
+	unsigned char i;
+	unsigned char j;
+};
+
+static inline void rc4_key_setup(struct rc4_state *state,
+				 const unsigned char key[], int len)
+{
+	int i;
+	int j;
+
+	for (i = 0; i < 256; ++i)
+		state->s[i] = i;
+	for (i = 0, j = 0; i < 256; ++i) {
+		unsigned char t = state->s[i];
+
+		j = (j + state->s[i] + key[i % len]) % 256;
+		state->s[i] = state->s[j];
+		state->s[j] = t;
+	}
+	state->i = 0;
+	state->j = 0;
+}
+
+/* XOR the buffer with the next len bytes of the RC4-stream. */
+static inline void rc4_crypt(struct rc4_state *state, unsigned char *buf,
+			     size_t len)
+{
+	unsigned char i = state->i;
+	unsigned char j = state->j;
+	size_t idx;
+
+	for (idx = 0; idx < len; ++idx) {
+		unsigned char t = state->s[i];
+
+		i = (i + 1) % 256;
+		j = (j + state->s[i]) % 256;
+		state->s[i] = state->s[j];
+		state->s[j] = t;
+		buf[idx] ^= state->s[(state->s[i] + t) % 256];
+	}
+	state->i = i;
+	state->j = j;
+}
+
+#endif
@@ -3,16 +3,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
-#include <linux/ioctl.h>
+#include "hardcryptor.h"
 
 #define BUFFER_LEN 2048
 
-/* Magic number for the ioctl calls */
-#define CRY_IOC_MAGIC 'c'
-/* IOCTL-call values used for setting and getting the encryption key. */
-#define CRY_IOC_SET_KEY _IOW(CRY_IOC_MAGIC, 1, char*)
-#define CRY_IOC_GET_KEY _IOR(CRY_IOC_MAGIC, 2, char*)
-
 #define IOCTL_INVALID_CALL 6
 #define OLDKEY "thisIsOldKeyAndNowLongEnough"
 #define NEWKEY "newKeyHereAndThisIsAlsoLongEnough"
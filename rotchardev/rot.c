@@ -1,14 +1,50 @@
-#include <linux/ctype.h>
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/device.h>
 #include <linux/kernel.h>
 #include <linux/fs.h>
 #include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/ioctl.h>
+#include <linux/capability.h>
+#include <linux/kfifo.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/version.h>
 #include <asm/uaccess.h>
+#include "rot.h"
 #define DEVICE_NAME "rot"
 #define CLASS_NAME "rot"
-#define MESSAGE_SIZE 2048
+// Writes are copied from user and rotated in chunks of this size.
+#define CHUNK_SIZE PAGE_SIZE
+// Size of the alphabet that rotations are done in.
+#define ALPHABET_SIZE 26
+
+// Magic number for the ioctl calls.
+#define ROT_IOC_MAGIC 'r'
+// IOCTL-calls for setting and getting the rotation amount of the current session.
+// Any amount can be set, negative amounts rotate backwards like with the rotations parameter.
+#define ROT_IOC_SET_ROTATIONS _IOW(ROT_IOC_MAGIC, 1, int)
+#define ROT_IOC_GET_ROTATIONS _IOR(ROT_IOC_MAGIC, 2, int)
+// IOCTL-call for setting the rotation amount used by every session which has not set its own.
+#define ROT_IOC_SET_DEFAULT_ROTATIONS _IOW(ROT_IOC_MAGIC, 3, int)
+// Session rotation value which means that the module-wide rotations parameter is followed.
+#define ROT_FOLLOW_DEFAULT -1
+// IOCTL-call which makes the current session follow the default rotation amount again.
+#define ROT_IOC_RESET_ROTATIONS _IO(ROT_IOC_MAGIC, 8)
+// IOCTL-calls for setting and getting the fan-out mode of the current session.
+// Argument is a bitmask where bit n selects rotation by n, zero turns the fan-out mode off.
+#define ROT_IOC_SET_FANOUT _IOW(ROT_IOC_MAGIC, 4, __u32)
+#define ROT_IOC_GET_FANOUT _IOR(ROT_IOC_MAGIC, 5, __u32)
+// Fan-out mask which selects all rotations from ROT-1 to ROT-25.
+#define ROT_FANOUT_ALL 0x03fffffe
+// IOCTL-calls for setting and getting the lazy mode of the current session.
+// In the lazy mode data is queued as written and rotated while it is read.
+#define ROT_IOC_SET_LAZY _IOW(ROT_IOC_MAGIC, 6, int)
+#define ROT_IOC_GET_LAZY _IOR(ROT_IOC_MAGIC, 7, int)
+// Bytes rotated at a time on the read path of the lazy mode, small enough to stay in the cache.
+#define LAZY_BLOCK_SIZE 256
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("putsi");
@@ -17,19 +53,71 @@ MODULE_VERSION("1.1");
 
 // How many times a character will be rotated for.
 static int rotations = 13;
-// rotations is int and can be read but cannot be modified.
-module_param(rotations, int, S_IRUGO);
+
+// Bring any rotation amount to range 0-25, so that negative values rotate backwards.
+static int normalize_rotations(int n) {
+	return ((n % ALPHABET_SIZE) + ALPHABET_SIZE) % ALPHABET_SIZE;
+}
+
+// Setter for the rotations parameter, the new value is published with a single store
+// so that operations which are already running keep using the value they started with.
+static int rotations_set(const char* val, const struct kernel_param* kp) {
+	int n;
+	int ret = kstrtoint(val, 10, &n);
+	if (ret < 0) {
+		return ret;
+	}
+	WRITE_ONCE(rotations, normalize_rotations(n));
+	printk(KERN_INFO "ROT: Default rotation amount changed to %d.\n", rotations);
+	return 0;
+}
+
+static const struct kernel_param_ops rotations_ops = {
+	.set = rotations_set,
+	.get = param_get_int,
+};
+
+// rotations is int and can be read by everyone and modified by root through sysfs.
+module_param_cb(rotations, &rotations_ops, &rotations, S_IRUGO | S_IWUSR);
 // rotations parameter description.
 MODULE_PARM_DESC(rotations, "How many times a character will be rotated (default is ROT13).");
 
+// How many bytes of rotated messages can be queued in a session before writers have to wait.
+static int queueSize = 16 * CHUNK_SIZE;
+// queueSize is int and can be read but cannot be modified.
+module_param(queueSize, int, S_IRUGO);
+// queueSize parameter description.
+MODULE_PARM_DESC(queueSize, "Size of the per-session message queue in bytes (rounded up to a power of two).");
+
+// Per open file state of the device.
+struct rot_session {
+	// Rotation amount of this session or ROT_FOLLOW_DEFAULT.
+	int rotations;
+	// Rotated messages waiting to be read.
+	struct kfifo fifo;
+	// Protects the queue and the message buffer from concurrent readers and writers.
+	struct mutex lock;
+	// Readers wait here for data to arrive.
+	wait_queue_head_t readQueue;
+	// Writers wait here for room in the queue.
+	wait_queue_head_t writeQueue;
+	// Chunk of the data given by user is rotated here before it is queued.
+	char* chunk;
+	// Rotations selected for the fan-out mode, zero when the mode is off.
+	u32 fanoutMask;
+	// How many rotations are selected and the rotation amounts themselves in ascending order.
+	int fanoutCount;
+	unsigned char fanoutRotations[ALPHABET_SIZE];
+	// All selected rotations of a chunk are laid out here before they are queued.
+	char* fanout;
+	// Queued data is not rotated yet, it is rotated while it is read.
+	bool lazy;
+};
+
 // Device number will be stored here.
 static int majorNum;
-// Initialize memory for the message given by user.
-static char msg[MESSAGE_SIZE] = {0};
-// Variable for storing length of the string.
-static short msgSize;
 // How many times the device has been opened.
-static int openCount;
+static atomic_t openCount = ATOMIC_INIT(0);
 static struct class* rotClass = NULL;
 static struct device* rotDevice = NULL;
 
@@ -38,35 +126,90 @@ static int rot_open(struct inode*, struct file*);
 static int rot_release(struct inode*, struct file*);
 static ssize_t rot_read(struct file*, char*, size_t, loff_t*);
 static ssize_t rot_write(struct file*, const char*, size_t, loff_t*);
+static long rot_ioctl(struct file*, unsigned int, unsigned long);
+static __poll_t rot_poll(struct file*, poll_table*);
 
 // Linux file structure operations which the character device will support.
 static struct file_operations fops =
 {
+	// Open files hold a reference to the module, so it is never unloaded under them.
+	.owner = THIS_MODULE,
 	.open = rot_open,
 	.read = rot_read,
 	.write = rot_write,
 	.release = rot_release,
+	.unlocked_ioctl = rot_ioctl,
+	.poll = rot_poll,
+	.llseek = noop_llseek,
 };
 
-//Lets declare a mutex which can be used to avoid race conditions.
-static DEFINE_MUTEX(rot_mutex);
+// Returns the rotation amount which should be used by the session.
+// The value is read once per operation, so a concurrent reconfiguration never blocks it.
+static int rot_session_rotations(struct rot_session* session) {
+	int n = READ_ONCE(session->rotations);
+	if (n == ROT_FOLLOW_DEFAULT) {
+		n = READ_ONCE(rotations);
+	}
+	return n;
+}
+
+// Returns the first letter of the alphabet c belongs to, or 0 if c is not an ASCII letter.
+// Kernel's isalpha also accepts Latin-1 letters, which would break UTF-8 and binary data.
+static char alphabet_base(char c) {
+	if (c >= 'a' && c <= 'z') {
+		return 'a';
+	}
+	if (c >= 'A' && c <= 'Z') {
+		return 'A';
+	}
+	return 0;
+}
 
 // Rotation function.
-static void rotate(void) {
+static void rotate(char* buf, size_t len, int n) {
 	// Loop through each character.
-	int i = 0;
-	for(i = 0; i < msgSize; i++) {
-		char c = msg[i];
-		// If currect character is end of string, return.
-		if (c == '\0') {
-			return;
-		}
+	size_t i = 0;
+	for(i = 0; i < len; i++) {
+		char c = buf[i];
+		char alpha = alphabet_base(c);
 		// Rotate current character by specified amount of characters.
-		if (isalpha(c)) {
-			char alpha = islower(c) ? 'a' : 'A';
-			c = (c - alpha + rotations) % 26 + alpha;
+		if (alpha != 0) {
+			c = (c - alpha + n) % ALPHABET_SIZE + alpha;
+		}
+		buf[i] = c;
+	}
+}
+
+// Rotation function for other modules, amount can be any integer.
+void rot_transform(char* buf, size_t len, int rotations) {
+	rotate(buf, len, normalize_rotations(rotations));
+}
+EXPORT_SYMBOL_GPL(rot_transform);
+
+// Fan-out rotation function which writes every selected rotation of the input to output.
+// Output will contain count blocks of len bytes, one for each rotation in the order given.
+// Each input character is loaded and classified only once for all of the rotations.
+static void rotate_fanout(const char* in, char* out, size_t len, const unsigned char* amounts, int count) {
+	size_t i = 0;
+	int k = 0;
+	for(i = 0; i < len; i++) {
+		char c = in[i];
+		char* dst = out + i;
+		char alpha = alphabet_base(c);
+		if (alpha != 0) {
+			int base = c - alpha;
+			for(k = 0; k < count; k++, dst += len) {
+				int r = base + amounts[k];
+				if (r >= ALPHABET_SIZE) {
+					r -= ALPHABET_SIZE;
+				}
+				*dst = alpha + r;
+			}
+		} else {
+			for(k = 0; k < count; k++, dst += len) {
+				*dst = c;
+			}
 		}
-		msg[i] = c;
 	}
 }
 
@@ -83,7 +226,11 @@ static int __init rot_init(void) {
 	printk(KERN_INFO "ROT: Registered with major number %d.\n", majorNum);
 
 	// Register the device class.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+	rotClass = class_create(CLASS_NAME);
+#else
 	rotClass = class_create(THIS_MODULE, CLASS_NAME);
+#endif
 	if (IS_ERR(rotClass)) {
 		unregister_chrdev(majorNum, DEVICE_NAME);
 		printk(KERN_ALERT "ROT: Could not register the device class!\n");
@@ -101,9 +248,6 @@ static int __init rot_init(void) {
 	}
 	printk(KERN_INFO "ROT: Created the device to /dev/%s.\n", DEVICE_NAME);
 
-	// Initialize our mutex.
-	mutex_init(&rot_mutex);
-
 	return 0;
 }
 
@@ -112,60 +256,321 @@ static void __exit rot_exit(void) {
 	device_destroy(rotClass, MKDEV(majorNum, 0));
 	class_destroy(rotClass);
 	unregister_chrdev(majorNum, DEVICE_NAME);
-	mutex_destroy(&rot_mutex);
 	printk(KERN_INFO "ROT: ROT LKM unloaded successfully.\n");
 }
 
 // Function which will be executed on device open.
 static int rot_open(struct inode* inodep, struct file* filep) {
-	// Make sure that the device is not already in use.
-	if (!mutex_trylock(&rot_mutex)) {
-		printk(KERN_ALERT "ROT: Device is in use by another process!");
-		return -EBUSY;
+	struct rot_session* session;
+
+	// Every opener gets its own session, so any number of processes can use the device at once.
+	// Sessions follow the module-wide rotation amount until they set their own.
+	session = kzalloc(sizeof(*session), GFP_KERNEL);
+	if (session == NULL) {
+		return -ENOMEM;
+	}
+	session->rotations = ROT_FOLLOW_DEFAULT;
+	// The queue must be able to hold at least one whole message.
+	if (kfifo_alloc(&session->fifo, max_t(int, queueSize, CHUNK_SIZE), GFP_KERNEL)) {
+		kfree(session);
+		return -ENOMEM;
 	}
+	session->chunk = (char*)__get_free_page(GFP_KERNEL);
+	if (session->chunk == NULL) {
+		kfifo_free(&session->fifo);
+		kfree(session);
+		return -ENOMEM;
+	}
+	mutex_init(&session->lock);
+	init_waitqueue_head(&session->readQueue);
+	init_waitqueue_head(&session->writeQueue);
+	filep->private_data = session;
 
-	openCount++;
-	printk(KERN_INFO "ROT: Opened the device for the %dth time.\n", openCount);
+	printk(KERN_INFO "ROT: Opened the device for the %dth time.\n", atomic_inc_return(&openCount));
+	return 0;
+}
+
+// Read path of the lazy mode, rotates queued data block by block right before it is copied to the user.
+// Rotation amount is the one in use at the time of the read. Must be called with the session lock held.
+static int rot_read_lazy(struct rot_session* session, char* buffer, size_t len, unsigned int* copied) {
+	char block[LAZY_BLOCK_SIZE];
+	int n = rot_session_rotations(session);
+	unsigned int count;
+
+	*copied = 0;
+	while (*copied < len && !kfifo_is_empty(&session->fifo)) {
+		count = kfifo_out(&session->fifo, block, min_t(size_t, len - *copied, LAZY_BLOCK_SIZE));
+		rotate(block, count, n);
+		// Block which could not be copied is lost, like with any failed read.
+		if (copy_to_user(buffer + *copied, block, count)) {
+			return -EFAULT;
+		}
+		*copied += count;
+	}
 	return 0;
 }
 
 // Function which will be used when data is read from the character device.
+// Reader waits until there is something queued, unless the device was opened with O_NONBLOCK.
+// Output can be drained with any read size, file offset tells how many bytes have been read so far.
 static ssize_t rot_read(struct file* filep, char* buffer, size_t len, loff_t* offset) {
-	int errorCount = 0;
-	errorCount = copy_to_user(buffer, msg, msgSize);
-	if (errorCount == 0) {
-		printk(KERN_INFO "ROT: Sent %d characters to user.\n", msgSize);
-		msgSize = 0;
-		return(0);
+	struct rot_session* session = filep->private_data;
+	unsigned int copied = 0;
+	int ret;
+
+	if (mutex_lock_interruptible(&session->lock)) {
+		return -ERESTARTSYS;
+	}
+	while (kfifo_is_empty(&session->fifo)) {
+		mutex_unlock(&session->lock);
+		if (filep->f_flags & O_NONBLOCK) {
+			return -EAGAIN;
+		}
+		if (wait_event_interruptible(session->readQueue, !kfifo_is_empty(&session->fifo))) {
+			return -ERESTARTSYS;
+		}
+		if (mutex_lock_interruptible(&session->lock)) {
+			return -ERESTARTSYS;
+		}
+	}
+
+	if (session->lazy) {
+		ret = rot_read_lazy(session, buffer, len, &copied);
 	} else {
-		printk(KERN_INFO "ROT: Could not send %d characters to user!\n", msgSize);
-		return -EFAULT;
+		ret = kfifo_to_user(&session->fifo, buffer, len, &copied);
+	}
+	mutex_unlock(&session->lock);
+	if (ret != 0 && copied == 0) {
+		printk(KERN_INFO "ROT: Could not send %zu characters to user!\n", len);
+		return ret;
 	}
+
+	// There is now room for more data.
+	wake_up_interruptible(&session->writeQueue);
+	printk(KERN_INFO "ROT: Sent %u characters to user.\n", copied);
+	*offset += copied;
+	return copied;
 }
 
 // Function which will be used when data is written to the character device.
 // filep is a pointer to a file object.
-// buffer is a pointer to the string which is to be written.
-// len is length of the string buffer.
+// buffer is a pointer to the data which is to be written.
+// len is length of the data in buffer, data may be of any size and may contain any bytes.
+// Data is rotated and queued chunk by chunk, so readers can drain the queue while the write is running.
+// Writer waits for room in the queue, unless the device was opened with O_NONBLOCK.
+// In the fan-out mode a write accepts a single block of data, whose selected rotations are
+// queued back to back, so the return value tells how much of the data was consumed.
 static ssize_t rot_write(struct file* filep, const char* buffer, size_t len, loff_t* offset) {
-	// Write characters in buffer to the message.
-	sprintf(msg, "%s", buffer);
-	msgSize = strlen(msg);
-	printk(KERN_INFO "ROT: Received %d characters to device!\n", msgSize);
+	struct rot_session* session = filep->private_data;
+	// Take a snapshot of the rotation amount for the whole operation.
+	int n = rot_session_rotations(session);
+	size_t written = 0;
+	ssize_t ret = 0;
+
+	printk(KERN_INFO "ROT: Rotating %zu characters by %d characters.\n", len, n);
+	while (written < len) {
+		size_t chunk = min_t(size_t, len - written, CHUNK_SIZE);
+		size_t needed = 1;
+		int count;
+
+		if (mutex_lock_interruptible(&session->lock)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+		// Fan-out block is cut to what fits to the queue now, like poll tells, as the write is short anyway.
+		count = session->fanoutCount;
+		if (count > 0) {
+			chunk = min_t(size_t, chunk, kfifo_avail(&session->fifo) / count);
+			needed = count;
+		}
+		if (kfifo_avail(&session->fifo) < needed) {
+			mutex_unlock(&session->lock);
+			if (filep->f_flags & O_NONBLOCK) {
+				ret = -EAGAIN;
+				break;
+			}
+			if (wait_event_interruptible(session->writeQueue, kfifo_avail(&session->fifo) >= needed)) {
+				ret = -ERESTARTSYS;
+				break;
+			}
+			continue;
+		}
+
+		// Copy as much as fits to both the chunk buffer and the queue.
+		if (count == 0) {
+			chunk = min_t(size_t, chunk, kfifo_avail(&session->fifo));
+		}
+		// Lazy mode queues the data straight from the user, it is rotated by the reader.
+		if (session->lazy) {
+			unsigned int copied;
+			int failed;
+
+			// On a fault the bytes copied before it stay queued, so they count as written.
+			failed = kfifo_from_user(&session->fifo, buffer + written, chunk, &copied);
+			mutex_unlock(&session->lock);
+			written += copied;
+			if (copied > 0) {
+				wake_up_interruptible(&session->readQueue);
+			}
+			if (failed) {
+				ret = -EFAULT;
+				break;
+			}
+			continue;
+		}
+		if (copy_from_user(session->chunk, buffer + written, chunk)) {
+			mutex_unlock(&session->lock);
+			ret = -EFAULT;
+			break;
+		}
+		if (count > 0) {
+			rotate_fanout(session->chunk, session->fanout, chunk, session->fanoutRotations, count);
+			kfifo_in(&session->fifo, session->fanout, chunk * count);
+		} else {
+			rotate(session->chunk, chunk, n);
+			kfifo_in(&session->fifo, session->chunk, chunk);
+		}
+		mutex_unlock(&session->lock);
+
+		written += chunk;
+		wake_up_interruptible(&session->readQueue);
+		if (count > 0) {
+			break;
+		}
+	}
+
+	// Report partial writes as success, the error is seen on the next call.
+	if (written > 0) {
+		return written;
+	}
+	return ret;
+}
 
-	// Lets rotate the message.
-	printk(KERN_INFO "ROT: Rotating message by %d characters.", rotations);
-	rotate();
+// Function which will be used when an ioctl call is done to the character device.
+// Rotation amount can be set for the current session or for all sessions.
+static long rot_ioctl(struct file* filep, unsigned int cmd, unsigned long arg) {
+	struct rot_session* session = filep->private_data;
+	u32 mask;
+	int n;
 
-	return msgSize;
+	switch (cmd) {
+	case ROT_IOC_SET_ROTATIONS:
+		if (get_user(n, (int*)arg)) {
+			return -EFAULT;
+		}
+		n = normalize_rotations(n);
+		WRITE_ONCE(session->rotations, n);
+		printk(KERN_INFO "ROT: Session rotation amount changed to %d.\n", n);
+		return 0;
+	case ROT_IOC_RESET_ROTATIONS:
+		WRITE_ONCE(session->rotations, ROT_FOLLOW_DEFAULT);
+		printk(KERN_INFO "ROT: Session follows the default rotation amount.\n");
+		return 0;
+	case ROT_IOC_GET_ROTATIONS:
+		return put_user(rot_session_rotations(session), (int*)arg);
+	case ROT_IOC_SET_DEFAULT_ROTATIONS:
+		if (!capable(CAP_SYS_ADMIN)) {
+			return -EPERM;
+		}
+		if (get_user(n, (int*)arg)) {
+			return -EFAULT;
+		}
+		WRITE_ONCE(rotations, normalize_rotations(n));
+		printk(KERN_INFO "ROT: Default rotation amount changed to %d.\n", rotations);
+		return 0;
+	case ROT_IOC_SET_FANOUT:
+		if (get_user(mask, (u32*)arg)) {
+			return -EFAULT;
+		}
+		if (mask & ~(BIT(ALPHABET_SIZE) - 1)) {
+			return -EINVAL;
+		}
+		if (mutex_lock_interruptible(&session->lock)) {
+			return -ERESTARTSYS;
+		}
+		// Fan-out blocks are laid out at write time, so they can't be used with the lazy mode.
+		if (mask != 0 && session->lazy) {
+			mutex_unlock(&session->lock);
+			return -EINVAL;
+		}
+		// Buffer for the rotated blocks is allocated when the mode is used for the first time.
+		if (mask != 0 && session->fanout == NULL) {
+			session->fanout = kvmalloc(ALPHABET_SIZE * CHUNK_SIZE, GFP_KERNEL);
+			if (session->fanout == NULL) {
+				mutex_unlock(&session->lock);
+				return -ENOMEM;
+			}
+		}
+		session->fanoutMask = mask;
+		session->fanoutCount = 0;
+		for (n = 0; n < ALPHABET_SIZE; n++) {
+			if (mask & BIT(n)) {
+				session->fanoutRotations[session->fanoutCount++] = n;
+			}
+		}
+		mutex_unlock(&session->lock);
+		printk(KERN_INFO "ROT: Session fan-out mode set to %d rotations.\n", session->fanoutCount);
+		return 0;
+	case ROT_IOC_GET_FANOUT:
+		return put_user(READ_ONCE(session->fanoutMask), (u32*)arg);
+	case ROT_IOC_SET_LAZY:
+		if (get_user(n, (int*)arg)) {
+			return -EFAULT;
+		}
+		if (mutex_lock_interruptible(&session->lock)) {
+			return -ERESTARTSYS;
+		}
+		// Queue must not mix rotated and unrotated data.
+		if (!kfifo_is_empty(&session->fifo)) {
+			mutex_unlock(&session->lock);
+			return -EBUSY;
+		}
+		if (n != 0 && session->fanoutCount > 0) {
+			mutex_unlock(&session->lock);
+			return -EINVAL;
+		}
+		session->lazy = n != 0;
+		mutex_unlock(&session->lock);
+		printk(KERN_INFO "ROT: Session lazy mode set to %d.\n", n != 0);
+		return 0;
+	case ROT_IOC_GET_LAZY:
+		return put_user((int)READ_ONCE(session->lazy), (int*)arg);
+	default:
+		printk(KERN_INFO "ROT: Received invalid IOCTL call (%u).\n", cmd);
+		return -ENOTTY;
+	}
+}
+
+// Function which will be used when the device is polled or selected by the userspace user.
+// Device is readable when there is queued data and writable when there is room for at least one more byte
+// (or one byte of every selected rotation in the fan-out mode).
+static __poll_t rot_poll(struct file* filep, poll_table* wait) {
+	struct rot_session* session = filep->private_data;
+	__poll_t mask = 0;
+
+	poll_wait(filep, &session->readQueue, wait);
+	poll_wait(filep, &session->writeQueue, wait);
+
+	if (!kfifo_is_empty(&session->fifo)) {
+		mask |= EPOLLIN | EPOLLRDNORM;
+	}
+	if (kfifo_avail(&session->fifo) >= max(READ_ONCE(session->fanoutCount), 1)) {
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	}
+	return mask;
 }
 
 // Function which will be used when the device is closed by the userspace user.
 // inodep is a pointer to an inode object (see linux/fs.h).
 // filep is a pointer to a file objec (see linux/fs.h).
 static int rot_release(struct inode* inodep, struct file* filep) {
-	// Release the mutex so that the device can be used by another users/processes.
-	mutex_unlock(&rot_mutex);
+	struct rot_session* session = filep->private_data;
+
+	kvfree(session->fanout);
+	free_page((unsigned long)session->chunk);
+	kfifo_free(&session->fifo);
+	mutex_destroy(&session->lock);
+	kfree(session);
 
 	printk(KERN_INFO "ROT: Device closed succesfully.\n");
 	return 0;
@@ -0,0 +1,10 @@
+#ifndef ROT_H
+#define ROT_H
+
+#include <linux/types.h>
+
+// Rotates every alphabetic character in buf by given amount, any other bytes are left as they are.
+// Exported by the rot module so that other modules can use the transform on kernel buffers.
+void rot_transform(char* buf, size_t len, int rotations);
+
+#endif
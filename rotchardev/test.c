@@ -3,12 +3,19 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
+#include <sys/ioctl.h>
+
+// Magic number for the ioctl calls.
+#define ROT_IOC_MAGIC 'r'
+// IOCTL-calls for setting and getting the rotation amount of the current session.
+#define ROT_IOC_SET_ROTATIONS _IOW(ROT_IOC_MAGIC, 1, int)
+#define ROT_IOC_GET_ROTATIONS _IOR(ROT_IOC_MAGIC, 2, int)
 
 #define BUFFER_LEN 2048
 static char recvBuffer[BUFFER_LEN];
 
 int main() {
-	int ret, fd;
+	int ret, fd, rotations;
 	char msg[BUFFER_LEN];
 	printf("Opening the rot device\n");
 	fd = open("/dev/rot", O_RDWR);
@@ -17,6 +24,10 @@ int main() {
 		return errno;
 	}
 
+	if (ioctl(fd, ROT_IOC_GET_ROTATIONS, &rotations) == 0) {
+		printf("Current rotation amount: %d\n", rotations);
+	}
+
 	printf("String that will be rotated: ");
 	scanf("%[^\n]%*c", msg);
 	int msgLen = strlen(msg);